@@ -251,7 +251,8 @@ size_t certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_s
 int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
 {
   mipki_state *st = (mipki_state*)cbs;
-  mipki_chain chain = mipki_parse_chain(st, (char*)chain_bytes, chain_len);
+  int valid = 0;
+  mipki_chain chain = mipki_parse_chain_validated(st, (char*)chain_bytes, chain_len, option_hostname, &valid);
 
   if(chain == NULL)
   {
@@ -259,8 +260,8 @@ int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain
     return 0;
   }
 
-  // We don't validate hostname, but could with the callback state
-  if(!mipki_validate_chain(st, chain, option_hostname))
+  // Repeated chains are validated once (see mipki_set_validation_cache)
+  if(!valid)
   {
     printf("WARNING: chain validation failed, ignoring.\n");
     // return 0;
@@ -12,6 +12,7 @@
 
 typedef struct mitls_state mitls_state;
 typedef struct quic_state quic_state;
+typedef struct mitls_config mitls_config;
 
 typedef struct {
   size_t ticket_len;
@@ -84,11 +85,21 @@ typedef void* (MITLS_CALLCONV *pfn_FFI_cert_select_cb)(void *cb_state, mitls_ver
 // Write the certificate chain to buffer, returning the number of written bytes.
 // The chain should be written by prefixing each certificate by its length encoded over 3 bytes
 typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_format_cb)(void *cb_state, const void *cert_ptr, unsigned char buffer[MAX_CHAIN_LEN]);
-// Tries to sign and write the signature to sig, returning the signature size or 0 if signature failed
+// Optionally used instead of the above (see FFI_mitls_configure_cert_get_chain): point *chain to the
+// certificate chain, in the same format, and return its length, or 0 on failure. The chain is not
+// copied, and must stay unchanged while connections use it, e.g. the image of mipki_get_chain.
+typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_get_chain_cb)(void *cb_state, const void *cert_ptr, const unsigned char **chain);
+// Tries to sign and write the signature to sig, returning the signature size or 0 if signature failed.
+// A TLS 1.3 server driven by FFI_mitls_process may instead return MITLS_CERT_PENDING, and later
+// write the signature to sig and call FFI_mitls_cert_complete(state, sig, size).
+// Only signing can be pending: TLS 1.2, QUIC and the blocking calls treat MITLS_CERT_PENDING
+// as a failed signature.
+#define MITLS_CERT_PENDING ((size_t)-1)
 typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_sign_cb)(void *cb_state, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig);
 // Verifies that the chain (given in the same format as above) is valid, and that sig is a valid signature
 // of tbs for sigalg using the public key stored in the leaf of the chain.
 // N.B. this function must validate the chain (including applcation checks such as hostname matching)
+// Verification is always synchronous, the callback cannot return a pending result.
 typedef int (MITLS_CALLCONV *pfn_FFI_cert_verify_cb)(void *cb_state, const unsigned char* chain, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len);
 
 typedef struct {
@@ -100,12 +111,53 @@ typedef struct {
 
 // Functions exported from libmitls.dll
 //   Functions returning 'int' return 0 for failure, or nonzero for success
+//   Distinct mitls_state may be used concurrently from different threads;
+//   calls on the same mitls_state are serialized.
 
 // Redirect debug tracing to a callback function.  This is process-wide and can
 // be called before or after FFI_mitls_init().
 typedef void (MITLS_CALLCONV *pfn_mitls_trace_callback)(const char *msg);
 extern void MITLS_CALLCONV FFI_mitls_set_trace_callback(pfn_mitls_trace_callback cb);
 
+// The modules of miTLS with their own trace level, named after the prefix of their traces
+typedef enum {
+  TLS_trace_all = -1, // all modules, in FFI_mitls_set_trace_level
+  TLS_trace_AEP = 0,  // AEAD provider: record nonces and keys
+  TLS_trace_CDH,      // Diffie-Hellman groups
+  TLS_trace_EPO,      // epochs
+  TLS_trace_FFI,
+  TLS_trace_HS,       // handshake
+  TLS_trace_HSL,      // handshake messages and transcript
+  TLS_trace_KS,       // key schedule
+  TLS_trace_NGO,      // negotiation
+  TLS_trace_QIC,      // QUIC
+  TLS_trace_RNG,      // random samples
+  TLS_trace_TCK,      // tickets
+  TLS_trace_TLS,
+  TLS_trace_REC,      // records
+  TLS_trace_modules
+} mitls_trace_module;
+
+typedef enum {
+  TLS_trace_off = 0,
+  TLS_trace_info = 1,    // protocol events
+  TLS_trace_verbose = 2  // also dumps keys, nonces and random samples
+} mitls_trace_level;
+
+// Set the trace level of a module. Messages above the level of their module are not
+// even formatted. By default, all modules trace at TLS_trace_verbose if the MITLS_LOG
+// environment variable is set, or once a trace callback is set, and are off otherwise.
+// Builds with MITLS_NODEBUG have no traces at all. Process-wide, at any time.
+extern void MITLS_CALLCONV FFI_mitls_set_trace_level(mitls_trace_module module, mitls_trace_level level);
+
+// Queue traces in a ring of up to records entries instead of printing them from the
+// connection threads. A background thread formats the queued traces and passes them to
+// the trace callback (or prints them), in order; traces are dropped while the ring is
+// full. Pass 0 to stop the thread once it has printed the queued traces. Call after
+// FFI_mitls_init() and FFI_mitls_set_trace_callback(), before creating connections.
+// Returns 0 if not supported (kernel mode).
+extern int MITLS_CALLCONV FFI_mitls_set_trace_ring(size_t records);
+
 // Perform one-time initialization
 extern int MITLS_CALLCONV FFI_mitls_init(void);
 
@@ -113,9 +165,94 @@ extern int MITLS_CALLCONV FFI_mitls_init(void);
 // and sealing key (used on the client side to seal session information for resumption)
 // alg is one of "AES128-GCM", "AES256-GCM", "CHACHA20-POLY1305", klen must account for
 // the key and IV (e.g. 32 + 12). If these keys are not set, fresh random keys will be used.
+// Setting a new key rotates it: the last 3 keys still decrypt the tickets they issued.
+// Setting the current key again has no effect.
 extern int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *ticketkey, size_t klen);
 extern int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned char *sealingkey, size_t klen);
 
+// Keep up to max_regions closed connections' memory per thread, for reuse by
+// the next connections created on that thread (0 disables reuse).
+// Process-wide, can be called at any time after FFI_mitls_init().
+extern void MITLS_CALLCONV FFI_mitls_set_region_pool_size(unsigned int max_regions);
+
+// Free the memory kept for reuse by the calling thread
+extern void MITLS_CALLCONV FFI_mitls_release_region_pool(void);
+
+// Counters of the process-wide session cache, which keeps the last session of
+// clients with each server (see FFI_mitls_configure_cached_resumption)
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t inserts;
+  uint64_t evictions;   // least recently used entries removed to stay under the memory cap
+  uint64_t expirations; // entries found past their lifetime
+  uint64_t entries;     // current number of entries
+  uint64_t bytes;       // current memory used by the entries
+  uint64_t store_hits;  // local misses found in the external session store
+  uint64_t store_misses;
+} mitls_session_cache_stats;
+
+// Bound the memory of the session cache to max_bytes (16MB by default) and the
+// lifetime of its entries to lifetime seconds (7 days by default). 0 keeps the
+// current value. Process-wide, can be called at any time after FFI_mitls_init().
+extern void MITLS_CALLCONV FFI_mitls_configure_session_cache(size_t max_bytes, uint32_t lifetime);
+extern void MITLS_CALLCONV FFI_mitls_get_session_cache_stats(/* out */ mitls_session_cache_stats *stats);
+
+// The kind of a session cache entry, in the callbacks of an external store
+typedef enum {
+  TLS_session_ticket = 0 // client: the last session with a server name (key)
+} mitls_session_kind;
+
+// Copy the value of key into value if it fits in value_len bytes, and return the
+// length of the value, or 0 if the store has no value for key. If the returned
+// length is larger than value_len, the callback is called again with a larger buffer.
+typedef size_t (MITLS_CALLCONV *pfn_session_get)(void *cb_state, mitls_session_kind kind,
+  const unsigned char *key, size_t key_len, /* out */ unsigned char *value, size_t value_len);
+
+// Store the value of key for at most lifetime seconds. The key and value are only
+// valid during the call: a store may copy them and write them later, e.g. in batches
+typedef void (MITLS_CALLCONV *pfn_session_put)(void *cb_state, mitls_session_kind kind,
+  const unsigned char *key, size_t key_len, const unsigned char *value, size_t value_len, uint32_t lifetime);
+
+// Remove key from the store, once its session is taken to resume
+typedef void (MITLS_CALLCONV *pfn_session_delete)(void *cb_state, mitls_session_kind kind,
+  const unsigned char *key, size_t key_len);
+
+typedef struct {
+  pfn_session_get get;    // may be NULL
+  pfn_session_put put;    // may be NULL
+  pfn_session_delete del; // may be NULL
+} mitls_session_store;
+
+// Share the session cache with other processes through an external store (for
+// instance in shared memory, or in a local daemon). The session cache forwards
+// every entry it adds to put, and looks up its misses with get before reporting
+// them. The callbacks may be called concurrently from any connection.
+// Client connections set up with FFI_mitls_configure_cached_resumption keep their
+// last session in the cache, and take it from the cache, locally or in the store,
+// to resume. The values contain the resumption secret of the session in the
+// clear: the store must protect them as keys. Servers resume from their tickets
+// only, so the workers of a server share the ticket key instead (see
+// FFI_mitls_set_ticket_key).
+// Must be called after FFI_mitls_init() and before creating connections; pass
+// NULL to remove the store.
+extern void MITLS_CALLCONV FFI_mitls_configure_session_store(void *cb_state, const mitls_session_store *store);
+
+// The number of pre-generated key shares to keep for a group, given by its TLS code point:
+// X25519 (0x001d) or FFDHE2048 to FFDHE8192 (0x0100 to 0x0104). The NIST curves are not pooled.
+typedef struct {
+  uint16_t group;
+  unsigned int depth;
+} mitls_key_pool_group;
+
+// Keep pre-generated key shares for the given groups, refilled by up to threads
+// low-priority background threads, so that handshakes do not wait for their key
+// generation. Each share is used once. An FFDHE pool starts filling once a connection
+// has used its group. Pass no groups to stop the threads and erase the pooled shares
+// (the default). Can be called at any time after FFI_mitls_init(); not supported in
+// kernel mode.
+extern void MITLS_CALLCONV FFI_mitls_configure_key_pool(unsigned int threads, const mitls_key_pool_group *groups, size_t groups_count);
+
 // Perform one-time termination
 extern void MITLS_CALLCONV FFI_mitls_cleanup(void);
 
@@ -125,6 +262,13 @@ extern int MITLS_CALLCONV FFI_mitls_configure(/* out */ mitls_state **state, con
 // Configure a ticket to resume (client only). Can be called more than once to offer multiple 1.3 PSK
 extern int MITLS_CALLCONV FFI_mitls_configure_ticket(mitls_state *state, const mitls_ticket *ticket);
 
+// Keep the last session with the server in the process-wide session cache, and resume
+// with it when no ticket is configured (client only; off by default). A session is
+// offered once, and only by connections with the same server name, versions, cipher
+// suites, signature algorithms, ALPN and scope, e.g. an application name for its
+// certificate callbacks and validation policy (scope_len may be 0).
+extern int MITLS_CALLCONV FFI_mitls_configure_cached_resumption(mitls_state *state, const unsigned char *scope, size_t scope_len);
+
 // Set configuration options ahead of connecting
 extern int MITLS_CALLCONV FFI_mitls_configure_cipher_suites(/* in */ mitls_state *state, const char *cs);
 extern int MITLS_CALLCONV FFI_mitls_configure_signature_algorithms(/* in */ mitls_state *state, const char *sa);
@@ -135,6 +279,19 @@ extern int MITLS_CALLCONV FFI_mitls_configure_custom_extensions(/* in */ mitls_s
 extern int MITLS_CALLCONV FFI_mitls_configure_ticket_callback(mitls_state *state, void *cb_state, pfn_FFI_ticket_cb ticket_cb);
 extern int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *cb_state, pfn_FFI_nego_cb nego_cb);
 extern int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb);
+// Send the chains returned by get_chain in place, instead of those written by the format callback.
+// Call after FFI_mitls_configure_cert_callbacks; QUIC connections get it from a shared config.
+extern int MITLS_CALLCONV FFI_mitls_configure_cert_get_chain(mitls_state *state, pfn_FFI_cert_get_chain_cb get_chain);
+
+// Turn a state set up by the functions above, before connecting, into an
+// immutable, reference-counted config. The state is consumed
+extern int MITLS_CALLCONV FFI_mitls_config_freeze(/* in */ mitls_state *state, /* out */ mitls_config **config);
+
+// Create a state from a shared config; only per-connection state is allocated
+extern int MITLS_CALLCONV FFI_mitls_configure_shared(/* out */ mitls_state **state, /* in */ mitls_config *config);
+
+// Release a reference to a config; it is freed when its last state is closed
+extern void MITLS_CALLCONV FFI_mitls_config_release(/* in */ mitls_config *config);
 
 // Close a miTLS session - either after configure or connect
 extern void MITLS_CALLCONV FFI_mitls_close(/* in */ mitls_state *state);
@@ -155,17 +312,167 @@ extern int MITLS_CALLCONV FFI_mitls_get_exporter(/* in */ mitls_state *state, in
 // Retrieve the server certificate after FFI_mitls_connect() completes
 extern void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* out */ size_t *cert_size);
 
+// Counters of a connection, kept from its creation. Times are in nanoseconds of a
+// monotonic clock. Except for the transport callbacks, the counters are kept per
+// thread, and stay at 0 in kernel mode.
+typedef struct {
+  uint64_t records_encrypted;
+  uint64_t bytes_encrypted;      // of plaintext
+  uint64_t records_decrypted;
+  uint64_t bytes_decrypted;
+  uint64_t messages_sent;        // handshake messages
+  uint64_t messages_received;
+  uint64_t key_exchange_ns;      // generating key shares and DH secrets
+  uint64_t certificate_ns;       // in the certificate callbacks
+  uint64_t key_schedule_ns;      // in HKDF
+  uint64_t transcript_ns;        // hashing the handshake transcript
+  uint64_t transport_sends;      // calls to the send callback
+  uint64_t transport_receives;   // calls to the recv callback
+  uint64_t heap_bytes;           // allocated in the heap region of the connection
+  uint64_t heap_peak_bytes;      // (both 0 unless built with REGION_STATISTICS)
+} mitls_stats;
+
+// Read the counters of a connection, from any thread. Waits for the call in
+// progress on the state, if any (e.g. a blocking FFI_mitls_connect)
+extern int MITLS_CALLCONV FFI_mitls_get_stats(/* in */ mitls_state *state, /* out */ mitls_stats *stats);
+
+// Process-wide handshake metrics, updated without locks by all connections (TLS
+// and QUIC) since the process started. The layout is stable: fields are only
+// appended, under a new MITLS_METRICS_VERSION.
+#define MITLS_METRICS_VERSION 1
+#define MITLS_METRICS_SLOTS 16     // code points counted per table, the last one for all others
+#define MITLS_METRICS_OTHER 0xffff // the code of the last slot of each table
+#define MITLS_LATENCY_BUCKETS 24   // bucket i counts latencies below 2^i microseconds
+                                   // (and not in bucket i-1); the last one has the rest
+
+// Outcome of the handshakes that negotiated a code point: a version, a cipher
+// suite or a group. Code 0 counts the handshakes that failed before negotiating it,
+// and, for groups, those without (EC)DHE. Unused slots have both counts at 0.
+typedef struct {
+  uint16_t code;
+  uint16_t reserved[3];
+  uint64_t completed;
+  uint64_t failed;
+} mitls_metrics_slot;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t buckets[MITLS_LATENCY_BUCKETS];
+} mitls_latency_histogram;
+
+typedef struct {
+  uint32_t size;    // set by the caller to sizeof(mitls_global_metrics); see below
+  uint32_t version; // MITLS_METRICS_VERSION of the library
+  uint64_t handshakes_started;
+  uint64_t handshakes_completed;
+  uint64_t handshakes_failed;
+  uint64_t resumption_hits;      // handshakes that offered a ticket or PSK, and resumed
+  uint64_t resumption_misses;    // ... and did not
+  uint64_t hello_retry_requests;
+  uint64_t early_data_accepted;
+  uint64_t early_data_rejected;  // offered, but not accepted
+  mitls_metrics_slot versions[MITLS_METRICS_SLOTS];
+  mitls_metrics_slot cipher_suites[MITLS_METRICS_SLOTS];
+  mitls_metrics_slot groups[MITLS_METRICS_SLOTS];
+  mitls_latency_histogram handshake_latency;   // from the first call on a connection to its completion or failure
+  mitls_latency_histogram certificate_latency; // of each certificate callback
+  uint64_t global_heap_bytes;      // allocated in the global region
+  uint64_t global_heap_peak_bytes; // (both 0 unless built with REGION_STATISTICS)
+} mitls_global_metrics;
+
+// Read the metrics, from any thread; the counters are read one at a time, not as
+// a snapshot. The caller sets metrics->size to the size of its structure, and the
+// library fills at most that many bytes and sets size to the bytes it filled, so
+// that callers built with an older header keep working. Latencies stay at 0 in
+// kernel mode. Returns 0 if metrics->size is too small for the first counter.
+extern int MITLS_CALLCONV FFI_mitls_get_global_metrics(/* in/out */ mitls_global_metrics *metrics);
+
+// Format the metrics in the Prometheus text exposition format, with latencies in
+// seconds. Returns the length of the full text, like snprintf: the text is only
+// complete if this is less than buffer_len, and is null-terminated if buffer_len > 0.
+extern size_t MITLS_CALLCONV FFI_mitls_format_global_metrics(/* out */ char *buffer, size_t buffer_len);
+
 // Send a message
 // Returns -1 for failure, or a TCP packet to be sent then freed with FFI_mitls_free()
 extern int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned char *buffer, size_t buffer_size);
 
+// A buffer to send, laid out like the POSIX struct iovec
+typedef struct {
+  const void *iov_base;
+  size_t iov_len;
+} mitls_iovec;
+
+// Send a message gathered from several buffers, packed into full-size
+// records and passed to the send callback at once. Records are encrypted
+// from the buffers; only those spanning two buffers are copied first.
+// Returns 0 for failure
+extern int MITLS_CALLCONV FFI_mitls_sendv(/* in */ mitls_state *state, const mitls_iovec *iov, size_t iov_count);
+
 // Receive a message
 // Returns NULL for failure, a plaintext packet to be freed with FFI_mitls_free_packet()
 extern unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size);
 
+// Receive a message copied into a caller-supplied buffer, instead of a packet
+// to be freed with FFI_mitls_free. This is not zero-copy: records are still
+// decrypted into plaintext allocated on the heap of the connection, which is
+// then copied to buffer; only the packet of FFI_mitls_receive is saved.
+// Returns 0 for failure; plaintext that does not fit is returned by the next call
+extern int MITLS_CALLCONV FFI_mitls_receive_copy(/* in */ mitls_state *state, /* out */ unsigned char *buffer, size_t buffer_size, /* out */ size_t *packet_size);
+
 // Free a packet returned FFI_mitls_*() family of APIs
 extern void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv);
 
+/*************************************************************************
+* Non-blocking TCP API
+**************************************************************************/
+
+// The host application owns the socket and moves bytes between it and
+// miTLS, e.g. from an event loop; miTLS never calls back into the host
+// to send or receive.
+
+#define TFLAG_COMPLETE 0x01 // the handshake is complete, FFI_mitls_send may be called
+#define TFLAG_WOULD_BLOCK 0x02 // all input has been consumed, call again when more is received
+#define TFLAG_DATA_PENDING 0x04 // more application data is ready, call again with a fresh data buffer
+#define TFLAG_CLOSED 0x08 // the peer closed the connection
+#define TFLAG_CERT_PENDING 0x10 // the handshake waits for FFI_mitls_cert_complete, call again after it
+
+typedef struct {
+  // Inputs
+  const unsigned char *input; // can be NULL, TLS records received from the peer
+  size_t input_len; // Size of input buffer (can be 0)
+  unsigned char *output; // can be NULL, a buffer to store TLS records to send
+  unsigned char *data; // can be NULL, a buffer to store received application data
+
+  // Input/Output
+  size_t output_len; // In: size of output buffer (can be 0), Out: bytes written to output
+  size_t data_len; // In: size of data buffer (can be 0), Out: bytes written to data
+
+  // Outputs
+  uint16_t tls_error; // alert code of a fatal TLS alert, sent or received
+  size_t consumed_bytes; // how many bytes of the input have been processed - leftover bytes must be processed in the next call
+  size_t to_be_written; // how many bytes are left to write (after writing *output)
+  size_t to_be_read; // how much application data is left to read (after reading *data)
+  uint16_t flags; // Bitfield of return flags (see above)
+} mitls_process_ctx;
+
+// Start a non-blocking client (is_server=0) or server (is_server=1) connection
+// on a configured state. Nothing is sent until the first FFI_mitls_process.
+extern int MITLS_CALLCONV FFI_mitls_process_start(/* in */ mitls_state *state, int is_server);
+
+// Process TLS records received from the peer and collect TLS records to send
+// and application data received. Never blocks; returns 0 on error.
+// After the handshake, FFI_mitls_send queues its records for the next call.
+extern int MITLS_CALLCONV FFI_mitls_process(/* in */ mitls_state *state, /* in/out */ mitls_process_ctx *ctx);
+
+// Complete a signature for which the sign callback returned MITLS_CERT_PENDING.
+// token is the sig buffer passed to the callback, which now holds sig_len bytes
+// of signature (0 if signing failed). May be called from any thread, including
+// from the callback itself; the handshake resumes on the next FFI_mitls_process.
+// Returns 0 if the signature was already completed, or if the handshake failed
+// or closed meanwhile.
+extern int MITLS_CALLCONV FFI_mitls_cert_complete(/* in */ mitls_state *state, const void *token, size_t sig_len);
+
 /*************************************************************************
 * QUIC API
 **************************************************************************/
@@ -253,6 +560,11 @@ typedef enum {
 extern int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *cfg);
 extern int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *state, quic_process_ctx *ctx);
 
+// Build a config once, and create connection states sharing it
+// (release the config with FFI_mitls_config_release)
+extern int MITLS_CALLCONV FFI_mitls_quic_config_create(/* out */ mitls_config **config, const quic_config *cfg);
+extern int MITLS_CALLCONV FFI_mitls_quic_create_shared(quic_state **state, mitls_config *config);
+
 // get_record_secrets can be called after the complete flag is set
 extern int MITLS_CALLCONV FFI_mitls_quic_get_record_key(quic_state *state, quic_raw_key *key, int32_t epoch, quic_direction rw);
 extern int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *state, quic_secret *crs, quic_secret *srs);
@@ -260,6 +572,10 @@ extern int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *state, q
 // Can be called after handshake completes to send a new ticket. Additional ticket data can be read back with get_hello_summary
 extern int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *state, const unsigned char *ticket_data, size_t ticket_data_len);
 
+// Read the counters of a QUIC connection (see mitls_stats; there are no records
+// nor transport callbacks). Waits for the call in progress on the state, if any
+extern int MITLS_CALLCONV FFI_mitls_quic_get_stats(quic_state *state, /* out */ mitls_stats *stats);
+
 // N.B. *cookie and *ticket_data must be freed with FFI_mitls_global_free as they are allocated in the global region
 extern int MITLS_CALLCONV FFI_mitls_get_hello_summary(const unsigned char *buffer, size_t buffer_len, int has_record, mitls_hello_summary *summary, unsigned char **cookie, size_t *cookie_len, unsigned char **ticket_data, size_t *ticket_data_len);
 
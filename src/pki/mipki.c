@@ -1,4 +1,7 @@
 /* -------------------------------------------------------------------- */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L // clock_gettime, with -std=c11
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -10,12 +13,76 @@
 
 #ifndef NO_OPENSSL
 
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #define NOCRYPT // wincrypt.h conflicts with OpenSSL
+  #include <windows.h>
+  typedef SRWLOCK mipki_lock;
+  typedef CONDITION_VARIABLE mipki_cond;
+  typedef HANDLE mipki_thread;
+  typedef volatile LONG mipki_refcount;
+  #define LOCK_INIT(l) InitializeSRWLock(&l)
+  #define LOCK_DESTROY(l)
+  #define REF_INCREMENT(x) InterlockedIncrement(x)
+  #define REF_DECREMENT(x) InterlockedDecrement(x)
+  #define POOL_INIT(l, c) (InitializeSRWLock(&l), InitializeConditionVariable(&c))
+  #define POOL_DESTROY(l, c)
+  #define POOL_LOCK(l) AcquireSRWLockExclusive(&l)
+  #define POOL_UNLOCK(l) ReleaseSRWLockExclusive(&l)
+  #define POOL_WAIT(c, l) SleepConditionVariableSRW(&c, &l, INFINITE, 0)
+  #define POOL_SIGNAL(c) WakeConditionVariable(&c)
+  #define POOL_BROADCAST(c) WakeAllConditionVariable(&c)
+  #define POOL_WORKER(f) DWORD WINAPI f(LPVOID arg)
+  #define POOL_START(t, f, a) ((t = CreateThread(NULL, 0, f, a, 0, NULL)) != NULL)
+  #define POOL_JOIN(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#else
+  #include <pthread.h>
+  typedef pthread_mutex_t mipki_lock;
+  typedef pthread_cond_t mipki_cond;
+  typedef pthread_t mipki_thread;
+  typedef int mipki_refcount;
+  #define LOCK_INIT(l) pthread_mutex_init(&l, NULL)
+  #define LOCK_DESTROY(l) pthread_mutex_destroy(&l)
+  #define REF_INCREMENT(x) __atomic_add_fetch(x, 1, __ATOMIC_ACQ_REL)
+  #define REF_DECREMENT(x) __atomic_sub_fetch(x, 1, __ATOMIC_ACQ_REL)
+  #define POOL_INIT(l, c) (pthread_mutex_init(&l, NULL), pthread_cond_init(&c, NULL))
+  #define POOL_DESTROY(l, c) (pthread_mutex_destroy(&l), pthread_cond_destroy(&c))
+  #define POOL_LOCK(l) pthread_mutex_lock(&l)
+  #define POOL_UNLOCK(l) pthread_mutex_unlock(&l)
+  #define POOL_WAIT(c, l) pthread_cond_wait(&c, &l)
+  #define POOL_SIGNAL(c) pthread_cond_signal(&c)
+  #define POOL_BROADCAST(c) pthread_cond_broadcast(&c)
+  #define POOL_WORKER(f) void* f(void *arg)
+  #define POOL_START(t, f, a) (pthread_create(&t, NULL, f, a) == 0)
+  #define POOL_JOIN(t) pthread_join(t, NULL)
+#endif
+
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
+#include <time.h>
 
 #include "mipki.h"
 
+// Default number of entries of the chain validation cache
+#ifndef MIPKI_CACHE_SIZE
+#define MIPKI_CACHE_SIZE 256
+#endif
+
+// Cached validation results are recomputed at least this often (in seconds),
+// and no later than the expiration of the chain
+#ifndef MIPKI_CACHE_TTL
+#define MIPKI_CACHE_TTL 3600
+#endif
+
+// Longer chains are not cached
+#define MIPKI_CACHE_MAX_CERTS 16
+
+// Number of idle validation contexts kept for reuse
+#ifndef MIPKI_STORE_CTX_POOL
+#define MIPKI_STORE_CTX_POOL 64
+#endif
+
 /*
  DESIGN NOTES
 
@@ -36,21 +103,108 @@ with the private key.
 
 */
 
+// A digest context initialized with the private key for a signature
+// algorithm (including RSA padding), copied for each signature
+typedef struct {
+  mipki_signature alg;
+  EVP_MD_CTX *ctx;
+} prepared_sig;
+
 // The parsed representation of chains and private keys
 typedef struct {
   X509* endpoint;
   STACK_OF(X509) *intermediates;
   EVP_PKEY* key;
+  int key_type; // EVP_PKEY_RSA, EVP_PKEY_EC, ...
+  int curve;    // NID of the curve of EC keys
+  char *wire;   // Read-only TLS network format of the chain
+  size_t wire_len;
+  prepared_sig *prepared; // One per signature algorithm usable with key
+  size_t prepared_len;
   int is_universal;
   int is_ephemeral;
+  mipki_refcount refs; // parsed chains: caller and validation cache references
 } config_entry;
 
+// A validation result, keyed by a hash of the chain and host
+typedef struct cache_entry {
+  unsigned char key[32];
+  config_entry *chain;
+  int valid;
+  time_t expires;
+  struct cache_entry *next; // in bucket
+  struct cache_entry *lru_prev, *lru_next; // most recently used first
+} cache_entry;
+
+// Hash table from (lowercase) DNS names to configuration entries.
+// For a given name, entries are chained in configuration order.
+typedef struct name_entry {
+  char *name;
+  size_t entry;
+  struct name_entry *next;
+} name_entry;
+
+typedef struct {
+  name_entry **buckets;
+  size_t mask;
+} name_index;
+
 typedef struct mipki_state {
+  mipki_refcount refs; // see mipki_acquire
   X509_STORE *store;
   config_entry *config; // Flat array
   size_t config_len;
+
+  // Certificate selection indexes, built by mipki_init
+  name_index names;     // exact names
+  name_index wildcards; // suffix of *.suffix names
+  size_t *others;       // universal entries, and entries with other
+  size_t others_len;    // wildcard patterns (checked with X509_check_host)
+
+  // Optional signing thread pool (see mipki_start_sign_pool)
+  struct sign_job *jobs, *jobs_tail;
+  mipki_lock jobs_lock;
+  mipki_cond jobs_cond;
+  mipki_thread *workers;
+  unsigned workers_len;
+  int stopping;
+
+  // Chain validation cache (see mipki_parse_chain_validated)
+  mipki_lock cache_lock;
+  cache_entry **cache;
+  size_t cache_mask;
+  cache_entry *lru_head, *lru_tail;
+  size_t cache_len;
+  size_t cache_max;
+
+  // Idle validation contexts, reused by mipki_validate_chain
+  mipki_lock ctx_lock;
+  X509_STORE_CTX *ctx_pool[MIPKI_STORE_CTX_POOL];
+  size_t ctx_pool_len;
 } mipki_state;
 
+// The state used by new connections, replaced by mipki_swap
+typedef struct mipki_current {
+  mipki_lock lock;
+  mipki_state *st;
+} mipki_current;
+
+typedef struct sign_job {
+  config_entry *cfg;
+  mipki_signature sigalg;
+  char *tbs;
+  size_t tbs_len;
+  char *sig;
+  size_t sig_len;
+  sign_callback cb;
+  void *cb_state;
+  struct sign_job *next;
+} sign_job;
+
+static int prepare_signing(config_entry *cfg);
+static void stop_sign_pool(mipki_state *st);
+static void cache_clear(mipki_state *st);
+
 #if DEBUG
 static void dump(const unsigned char *buffer, size_t len)
 {
@@ -104,9 +258,182 @@ int password_cb(char *buf, int size, int rwflag, void *p)
   return s->cb(buf, size, s->info);
 }
 
+static size_t name_hash(const char *name, size_t len)
+{
+  size_t h = 2166136261u; // FNV-1a
+  for(size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int index_init(name_index *idx, size_t n)
+{
+  size_t size = 16;
+  while(size < 2 * n) size <<= 1;
+  idx->buckets = calloc(size, sizeof(name_entry*));
+  idx->mask = size - 1;
+  return idx->buckets != NULL;
+}
+
+static int index_add(name_index *idx, const char *name, size_t len, size_t entry)
+{
+  name_entry *e = malloc(sizeof(name_entry));
+  if(!e) return 0;
+  e->name = malloc(len + 1);
+  if(!e->name) { free(e); return 0; }
+  for(size_t i = 0; i < len; i++)
+    e->name[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 32 : name[i];
+  e->name[len] = 0;
+  e->entry = entry;
+
+  // Entries are added in reverse configuration order
+  size_t b = name_hash(e->name, len) & idx->mask;
+  e->next = idx->buckets[b];
+  idx->buckets[b] = e;
+  return 1;
+}
+
+static void index_free(name_index *idx)
+{
+  if(!idx->buckets) return;
+  for(size_t b = 0; b <= idx->mask; b++)
+  {
+    name_entry *e = idx->buckets[b];
+    while(e)
+    {
+      name_entry *next = e->next;
+      free(e->name);
+      free(e);
+      e = next;
+    }
+  }
+  free(idx->buckets);
+  idx->buckets = NULL;
+}
+
+// Adds a DNS name (or CN) of entry i to the indexes.
+// Returns 0 on allocation failure, -1 if the name needs X509_check_host
+static int index_name(mipki_state *st, size_t i, const char *name, size_t len)
+{
+  if(len > 2 && name[0] == '*' && name[1] == '.' && !memchr(name + 2, '*', len - 2))
+    return index_add(&st->wildcards, name + 2, len - 2, i);
+  if(memchr(name, '*', len) || memchr(name, 0, len))
+    return -1;
+  return index_add(&st->names, name, len, i);
+}
+
+// Builds the certificate selection indexes over the SAN DNS names of
+// each certificate, or its CN if it has no DNS name, as X509_check_host
+static int build_indexes(mipki_state *st)
+{
+  if(!index_init(&st->names, st->config_len) || !index_init(&st->wildcards, st->config_len))
+    return 0;
+  st->others = malloc(sizeof(size_t) * (st->config_len + 1));
+  st->others_len = 0;
+  if(!st->others) return 0;
+
+  // In reverse order, so that the lists of entries of each name are in configuration order
+  for(size_t i = st->config_len; i-- > 0; )
+  {
+    config_entry *cfg = st->config + i;
+    int other = cfg->is_universal, dns = 0, r;
+
+    GENERAL_NAMES *gens = X509_get_ext_d2i(cfg->endpoint, NID_subject_alt_name, NULL, NULL);
+    for(int j = 0; gens && j < sk_GENERAL_NAME_num(gens); j++)
+    {
+      GENERAL_NAME *gen = sk_GENERAL_NAME_value(gens, j);
+      if(gen->type != GEN_DNS) continue;
+      dns = 1;
+      r = index_name(st, i, (const char*)ASN1_STRING_get0_data(gen->d.dNSName), ASN1_STRING_length(gen->d.dNSName));
+      if(!r) { GENERAL_NAMES_free(gens); return 0; }
+      if(r < 0) other = 1;
+    }
+    GENERAL_NAMES_free(gens);
+
+    if(!dns)
+    {
+      X509_NAME *subject = X509_get_subject_name(cfg->endpoint);
+      for(int j = -1; (j = X509_NAME_get_index_by_NID(subject, NID_commonName, j)) >= 0; )
+      {
+        unsigned char *cn;
+        int cn_len = ASN1_STRING_to_UTF8(&cn, X509_NAME_ENTRY_get_data(X509_NAME_get_entry(subject, j)));
+        if(cn_len < 0) continue;
+        r = index_name(st, i, (const char*)cn, cn_len);
+        OPENSSL_free(cn);
+        if(!r) return 0;
+        if(r < 0) other = 1;
+      }
+    }
+
+    if(other) st->others[st->others_len++] = i;
+  }
+
+  // others was filled in reverse order
+  for(size_t i = 0; i < st->others_len / 2; i++)
+  {
+    size_t t = st->others[i];
+    st->others[i] = st->others[st->others_len - 1 - i];
+    st->others[st->others_len - 1 - i] = t;
+  }
+  return 1;
+}
+
+// Writes the TLS network format of the chain to cfg->wire:
+// each certificate in DER, prefixed with its length over 3 bytes
+static int encode_chain(config_entry *cfg)
+{
+  int n = sk_X509_num(cfg->intermediates);
+  size_t len = 0;
+
+  for(int i = -1; i < n; i++)
+  {
+    int l = i2d_X509(i < 0 ? cfg->endpoint : sk_X509_value(cfg->intermediates, i), NULL);
+    if(l <= 0 || l > 0xFFFFFF) return 0;
+    len += 3 + l;
+  }
+
+  unsigned char *buf = malloc(len), *cur = buf;
+  if(!buf) return 0;
+
+  for(int i = -1; i < n; i++)
+  {
+    X509 *x509 = i < 0 ? cfg->endpoint : sk_X509_value(cfg->intermediates, i);
+    int l = i2d_X509(x509, NULL);
+
+    #if DEBUG
+      char nb[256];
+      X509_NAME_oneline(X509_get_subject_name(x509), nb, 256);
+      printf(" - Encoding: %s\n", nb);
+    #endif
+
+    *(cur++) = (l >> 16) & 0xFF;
+    *(cur++) = (l >> 8) & 0xFF;
+    *(cur++) = l & 0xFF;
+    i2d_X509(x509, &cur); // advances cur
+  }
+
+  cfg->wire = (char*)buf;
+  cfg->wire_len = len;
+  return 1;
+}
+
 void MITLS_CALLCONV mipki_free(mipki_state *st)
 {
-  if(!st) return;
+  if(!st || REF_DECREMENT(&st->refs) > 0) return;
+
+  stop_sign_pool(st);
+  cache_clear(st);
+  free(st->cache);
+  LOCK_DESTROY(st->cache_lock);
+  for(size_t i = 0; i < st->ctx_pool_len; i++)
+    X509_STORE_CTX_free(st->ctx_pool[i]);
+  LOCK_DESTROY(st->ctx_lock);
+  index_free(&st->names);
+  index_free(&st->wildcards);
+  free(st->others);
 
   for(size_t i=0; i<st->config_len; i++)
   {
@@ -114,6 +441,10 @@ void MITLS_CALLCONV mipki_free(mipki_state *st)
     X509_free(cfg->endpoint);
     EVP_PKEY_free(cfg->key);
     sk_X509_pop_free(cfg->intermediates, X509_free);
+    free(cfg->wire);
+    for(size_t j = 0; j < cfg->prepared_len; j++)
+      EVP_MD_CTX_free(cfg->prepared[j].ctx);
+    free(cfg->prepared);
   }
 
   free(st->config);
@@ -121,7 +452,123 @@ void MITLS_CALLCONV mipki_free(mipki_state *st)
   free(st);
 }
 
-mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+static uint64_t now_ms(void)
+{
+#if defined(_WIN32)
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// Loads the key and chain of a configuration entry into cfg
+static int load_entry(config_entry *cfg, const mipki_config_entry *cur, password_callback pcb)
+{
+  pass_cb_state cbs = {.cb = pcb, .info = cur->key_file};
+  STACK_OF(X509) *chain = sk_X509_new_null();
+  X509 *x509 = NULL;
+
+  if(!chain) return 0;
+  cfg->intermediates = chain;
+
+  BIO *bio = BIO_new_file(cur->key_file, "r");
+  if(!bio) return 0;
+
+  EVP_PKEY* sk = PEM_read_bio_PrivateKey(bio, NULL, password_cb, (void*)&cbs);
+  BIO_free(bio);
+  if(!sk) return 0;
+  cfg->key = sk;
+
+  bio = BIO_new_file(cur->cert_file, "r");
+  if(!bio) return 0;
+
+  for(size_t j = 0; ; j++)
+  {
+    x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+
+    if(!x509) {
+      int n = ERR_peek_last_error();
+      BIO_free(bio);
+
+      if(!j || !(ERR_GET_LIB(n) == ERR_LIB_PEM && ERR_GET_REASON(n) == PEM_R_NO_START_LINE))
+        return 0;
+      else
+        break; // Chain is complete, allegedly
+    }
+
+    // Check that the private key matches the first certificate in the file
+    if(!j) {
+      cfg->endpoint = x509;
+      if(!X509_check_private_key(x509, sk))
+      {
+        BIO_free(bio);
+        return 0;
+      }
+    } else {
+      sk_X509_push(chain, x509);
+    }
+  }
+
+  cfg->key_type = EVP_PKEY_type(EVP_PKEY_id(sk));
+  cfg->curve = (cfg->key_type == EVP_PKEY_EC)
+    ? EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(sk))) : 0;
+  cfg->is_universal = cur->is_universal;
+  cfg->is_ephemeral = 0;
+
+  return encode_chain(cfg) && prepare_signing(cfg);
+}
+
+// Shared by the loader threads of mipki_init_ex
+typedef struct {
+  mipki_state *st;
+  const mipki_config_entry *config;
+  password_callback pcb;
+  const mipki_init_options *opts;
+  uint64_t start;
+  mipki_refcount next;   // next entry to load
+  mipki_refcount loaded;
+  mipki_lock fail_lock;
+  size_t failed;         // lowest failed entry, or config_len
+} load_state;
+
+static POOL_WORKER(load_worker)
+{
+  load_state *ls = (load_state*)arg;
+  mipki_state *st = ls->st;
+  size_t interval = ls->opts ? ls->opts->progress_interval : 0;
+
+  while(1)
+  {
+    size_t i = (size_t)REF_INCREMENT(&ls->next) - 1;
+    if(i >= st->config_len) break;
+
+    POOL_LOCK(ls->fail_lock);
+    int stop = ls->failed < i;
+    POOL_UNLOCK(ls->fail_lock);
+    if(stop) break;
+
+    if(!load_entry(st->config + i, ls->config + i, ls->pcb))
+    {
+      #if DEBUG
+        printf("mipki_init: failed to load entry %d\n", (int)i);
+      #endif
+      POOL_LOCK(ls->fail_lock);
+      if(i < ls->failed) ls->failed = i;
+      POOL_UNLOCK(ls->fail_lock);
+      continue;
+    }
+
+    size_t loaded = (size_t)REF_INCREMENT(&ls->loaded);
+    if(interval && ls->opts->progress && loaded % interval == 0)
+      ls->opts->progress(ls->opts->progress_state, loaded, st->config_len, now_ms() - ls->start);
+  }
+
+  return 0;
+}
+
+mipki_state* MITLS_CALLCONV mipki_init_ex(const mipki_config_entry config[], size_t config_len, password_callback pcb, const mipki_init_options *opts, int *erridx)
 {
   *erridx = -1;
   X509_STORE *store = X509_STORE_new();
@@ -130,67 +577,103 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
   if(!X509_STORE_set_default_paths(store)) return 0;
   X509_STORE_set_verify_cb_func(store, cert_verify_cb);
 
-  mipki_state *st = malloc(sizeof(mipki_state));
-  config_entry *c = malloc(sizeof(config_entry) * config_len);
+  mipki_state *st = calloc(1, sizeof(mipki_state));
+  config_entry *c = calloc(config_len ? config_len : 1, sizeof(config_entry));
   if(!st || !c) return NULL;
 
+  // Entries are freed by mipki_free, even if partially loaded
+  st->refs = 1;
   st->store = store;
   st->config = c;
-  st->config_len = 0;
-
-  for(size_t i = 0; i < config_len; i++)
+  st->config_len = config_len;
+  LOCK_INIT(st->cache_lock);
+  LOCK_INIT(st->ctx_lock);
+  if(!mipki_set_validation_cache(st, MIPKI_CACHE_SIZE)) return NULL;
+
+  load_state ls = {
+    .st = st, .config = config, .pcb = pcb, .opts = opts,
+    .start = now_ms(), .next = 0, .loaded = 0, .failed = config_len };
+  LOCK_INIT(ls.fail_lock);
+
+  unsigned threads = (opts && opts->threads > 1) ? opts->threads : 1;
+  if(threads > config_len) threads = config_len ? config_len : 1;
+  mipki_thread *workers = malloc(threads * sizeof(mipki_thread));
+  unsigned started = 0;
+
+  // The calling thread is one of the loaders
+  while(workers && started + 1 < threads && POOL_START(workers[started], load_worker, &ls))
+    started++;
+  load_worker(&ls);
+  for(unsigned i = 0; i < started; i++)
+    POOL_JOIN(workers[i]);
+  free(workers);
+  LOCK_DESTROY(ls.fail_lock);
+
+  if(ls.failed < config_len || !build_indexes(st))
   {
-    *erridx = i;
-    config_entry *cfg = c + i;
-    const mipki_config_entry *cur = config + i;
-    pass_cb_state cbs = {.cb = pcb, .info = cur->key_file};
+    *erridx = (int)ls.failed;
+    mipki_free(st);
+    return NULL;
+  }
 
-    STACK_OF(X509) *chain = sk_X509_new_null();
-    X509 *x509 = NULL;
+  if(opts && opts->progress)
+    opts->progress(opts->progress_state, config_len, config_len, now_ms() - ls.start);
+  return st;
+}
 
-    if(!chain) return 0;
+mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+{
+  return mipki_init_ex(config, config_len, pcb, NULL, erridx);
+}
 
-    BIO *bio = BIO_new_file(cur->key_file, "r");
-    if(!bio) return 0;
+mipki_current* MITLS_CALLCONV mipki_current_new(mipki_state *st)
+{
+  assert(st != NULL);
+  mipki_current *cur = malloc(sizeof(mipki_current));
+  if(!cur) return NULL;
 
-    EVP_PKEY* sk = PEM_read_bio_PrivateKey(bio, NULL, password_cb, (void*)&cbs);
-    if(!sk || !BIO_free(bio)) return 0;
+  LOCK_INIT(cur->lock);
+  cur->st = st;
+  return cur;
+}
 
-    bio = BIO_new_file(cur->cert_file, "r");
-    if(!bio) return 0;
+mipki_state* MITLS_CALLCONV mipki_acquire(mipki_current *cur)
+{
+  assert(cur != NULL);
 
-    for(size_t j = 0; ; j++)
-    {
-      x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+  // The lock only covers reading the pointer and taking a reference,
+  // so that a concurrent mipki_swap cannot free the state in between
+  POOL_LOCK(cur->lock);
+  mipki_state *st = cur->st;
+  REF_INCREMENT(&st->refs);
+  POOL_UNLOCK(cur->lock);
 
-      if(!x509) {
-        int n = ERR_peek_last_error();
+  return st;
+}
 
-        if(!j || !(ERR_GET_LIB(n) == ERR_LIB_PEM && ERR_GET_REASON(n) == PEM_R_NO_START_LINE))
-          return 0;
-        else
-          break; // Chain is complete, allegedly
-      }
+void MITLS_CALLCONV mipki_swap(mipki_current *cur, mipki_state *next)
+{
+  assert(cur != NULL && next != NULL);
 
-      // Check that the private key matches the first certificate in the file
-      if(!j) {
-        if(!X509_check_private_key(x509, sk))
-          return 0;
+  POOL_LOCK(cur->lock);
+  mipki_state *old = cur->st;
+  cur->st = next;
+  POOL_UNLOCK(cur->lock);
 
-        cfg->endpoint = x509;
-      } else {
-        sk_X509_push(chain, x509);
-      }
-    }
+  #if DEBUG
+    printf("mipki_swap: %d entries replaced by %d\n", (int)old->config_len, (int)next->config_len);
+  #endif
 
-    st->config_len++;
-    cfg->intermediates = chain;
-    cfg->key = sk;
-    cfg->is_universal = cur->is_universal;
-    cfg->is_ephemeral = 0;
-  }
+  // Freed now, or by the last connection still using it
+  mipki_free(old);
+}
 
-  return st;
+void MITLS_CALLCONV mipki_current_free(mipki_current *cur)
+{
+  if(!cur) return;
+  mipki_free(cur->st);
+  LOCK_DESTROY(cur->lock);
+  free(cur);
 }
 
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file)
@@ -218,9 +701,87 @@ int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_f
   return X509_STORE_load_locations(st->store, ca_file, NULL);
 }
 
+// Returns the first offered signature algorithm compatible with the key of cfg, or 0
+static mipki_signature select_sigalg(const config_entry *cfg, const mipki_signature *algs, size_t algs_len)
+{
+  #if DEBUG
+    switch(cfg->key_type){
+      case EVP_PKEY_RSA:     printf(" - RSA key\n"); break;
+      case EVP_PKEY_EC:      printf(" - ECDSA key\n"); break;
+      case EVP_PKEY_ED25519: printf(" - EdDSA-25519 key\n"); break;
+    }
+  #endif
+
+  for(size_t j = 0; j < algs_len; j++)
+  {
+    mipki_signature alg = algs[j];
+    uint8_t low = algs[j] & 0xFF;
+    uint8_t high = algs[j] >> 8;
+
+    #if DEBUG
+    printf(" - Testing if <%02x,%02x> is suitable\n", high, low);
+    #endif
+
+    switch(cfg->key_type)
+    {
+      case EVP_PKEY_RSA:
+        if((high == 8 && (low == 4 || low == 5 || low == 6)) || // RSA_PSS
+           (low == 1 && high >= 2 && high <= 6) ||
+           (low == 0xFF && high == 0xFF)) // RSA_PKCS1
+          return alg;
+        break;
+
+      case EVP_PKEY_ED25519:
+        if(high == 8 && low == 7)
+          return alg;
+        break;
+
+      case EVP_PKEY_EC:
+        if((cfg->curve == NID_X9_62_prime256v1 && high == 4 && low == 3) ||
+           (cfg->curve == NID_secp384r1 && high == 5 && low == 3) ||
+           (cfg->curve == NID_secp521r1 && high == 6 && low == 3) ||
+           (high == 2 && low == 3))
+          return alg;
+        break;
+    }
+  }
+
+  return 0;
+}
+
+// Keeps the suitable candidate that comes first in the configuration
+static void select_candidate(mipki_state *st, size_t i, const mipki_signature *algs, size_t algs_len, size_t *best, mipki_signature *selected)
+{
+  if(i >= *best) return;
+
+  #if DEBUG
+    char buf[256];
+    X509_NAME_oneline(X509_get_subject_name(st->config[i].endpoint), buf, 256);
+    printf(" - Testing certificate: %s\n", buf);
+  #endif
+
+  mipki_signature alg = select_sigalg(st->config + i, algs, algs_len);
+  if(alg)
+  {
+    *best = i;
+    *selected = alg;
+  }
+}
+
+static void select_by_name(mipki_state *st, const name_index *idx, const char *name, size_t len, const mipki_signature *algs, size_t algs_len, size_t *best, mipki_signature *selected)
+{
+  for(name_entry *e = idx->buckets[name_hash(name, len) & idx->mask]; e; e = e->next)
+  {
+    if(e->entry < *best && strlen(e->name) == len && !memcmp(e->name, name, len))
+      select_candidate(st, e->entry, algs, algs_len, best, selected);
+  }
+}
+
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected)
 {
   assert(st != NULL);
+  char name[256];
+  size_t best = st->config_len;
 
   #if DEBUG
     char *sni_str = malloc(sni_len+1);
@@ -232,90 +793,45 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
     free(sni_str);
   #endif
 
-  for(size_t i = 0; i < st->config_len; i++)
-  {
-    config_entry *cfg = st->config + i;
-
-    #if DEBUG
-      char buf[256];
-      char *peername = NULL;
-      char **peer = &peername;
-      X509_NAME_oneline(X509_get_subject_name(cfg->endpoint), buf, 256);
-      printf(" - Testing certificate: %s\n", buf);
-    #else
-      char **peer = NULL; // save memory
-    #endif
-
-    // Server-side hostname validation to match wildcards, SAN, etc
-    if(cfg->is_universal || X509_check_host(cfg->endpoint, sni, sni_len, 0, peer))
-    {
-      #if DEBUG
-      printf(" - Positive match for <%s>\n", peername);
-      OPENSSL_free(peername);
-      #endif
+  *selected = 0;
 
-      int curve, kt = EVP_PKEY_type(EVP_PKEY_id(cfg->key));
-      *selected = 0;
+  // Names are case-insensitive, and at most 253 characters; an empty
+  // name matches no indexed entry
+  if(sni_len > 0 && sni_len < sizeof(name))
+  {
+    for(size_t i = 0; i < sni_len; i++)
+      name[i] = (sni[i] >= 'A' && sni[i] <= 'Z') ? sni[i] + 32 : sni[i];
 
-      #if DEBUG
-        switch(kt){
-          case EVP_PKEY_RSA:     printf(" - RSA key\n"); break;
-          case EVP_PKEY_EC:      printf(" - ECDSA key\n"); break;
-          case EVP_PKEY_ED25519: printf(" - EdDSA-25519 key\n"); break;
-        }
-      #endif
+    select_by_name(st, &st->names, name, sni_len, algs, algs_len, &best, selected);
 
-      for(size_t j = 0; j < algs_len; j++)
-      {
-        mipki_signature alg = algs[j];
-        uint8_t low = algs[j] & 0xFF;
-        uint8_t high = algs[j] >> 8;
+    // A wildcard only matches the leftmost label
+    const char *dot = memchr(name, '.', sni_len);
+    if(dot && dot > name)
+      select_by_name(st, &st->wildcards, dot + 1, sni_len - (dot + 1 - name), algs, algs_len, &best, selected);
+  }
 
-        #if DEBUG
-        printf(" - Testing if <%02x,%02x> is suitable\n", high, low);
-        #endif
+  for(size_t k = 0; k < st->others_len && st->others[k] < best; k++)
+  {
+    size_t i = st->others[k];
+    config_entry *cfg = st->config + i;
 
-        switch(kt)
-        {
-          case EVP_PKEY_RSA:
-            if((high == 8 && (low == 4 || low == 5 || low == 6)) || // RSA_PSS
-               (low == 1 && high >= 2 && high <= 6) ||
-               (low == 0xFF && high == 0xFF)) // RSA_PKCS1
-              *selected = alg;
-            break;
-
-          case EVP_PKEY_ED25519:
-            if(high == 8 && low == 7)
-              *selected = alg;
-            break;
-
-          case EVP_PKEY_EC:
-            curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(cfg->key)));
-            if((curve == NID_X9_62_prime256v1 && high == 4 && low == 3) ||
-               (curve == NID_secp384r1 && high == 5 && low == 3) ||
-               (curve == NID_secp521r1 && high == 6 && low == 3) ||
-               (high == 2 && low == 3))
-              *selected = alg;
-            break;
-        }
-
-        if(*selected)
-        {
-          #if DEBUG
-            printf(" + Certificate selected with alg=%04x\n", *selected);
-          #endif
-          break;
-        }
-      }
+    // Server-side hostname validation to match partial wildcards, etc
+    if(cfg->is_universal || X509_check_host(cfg->endpoint, sni, sni_len, 0, NULL) == 1)
+      select_candidate(st, i, algs, algs_len, &best, selected);
+  }
 
-      if(*selected)
-        return (void*)cfg;
-    }
+  if(best < st->config_len)
+  {
+    #if DEBUG
+      printf(" + Certificate selected with alg=%04x\n", *selected);
+    #endif
+    return (void*)(st->config + best);
   }
 
   *selected = 0;
   return NULL;
 }
+
 /*
 int EVP_DigestSignInit(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx,
                        const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
@@ -376,6 +892,89 @@ static int set_digest(mipki_signature sigalg, DIGEST* md)
 
 typedef int (*pfn_init)(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx, const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
 
+// Initializes md_ctx to sign or verify with key and sigalg
+static int init_digest(EVP_MD_CTX *md_ctx, EVP_PKEY *key, mipki_signature sigalg, mipki_mode mode)
+{
+  EVP_PKEY_CTX* key_ctx = NULL;
+  DIGEST md = NULL;
+
+  if(!set_digest(sigalg, &md)) return 0;
+
+  #if DEBUG
+    printf("Using the message digest: %s\n", md ? OBJ_nid2sn(EVP_MD_type(md)) : "NULL");
+  #endif
+
+  pfn_init init = (mode == MIPKI_SIGN ? EVP_DigestSignInit : EVP_DigestVerifyInit);
+  if(init(md_ctx, &key_ctx, md, NULL, key) != 1)
+  {
+    #if DEBUG
+      printf("mipki_sign_verify: failed to initialize DigestSign\n");
+    #endif
+    return 0;
+  }
+
+  // for RSA: set padding
+  if(EVP_PKEY_type(EVP_PKEY_id(key)) == EVP_PKEY_RSA)
+  {
+    if(sigalg >> 8 == 8) // PSS
+    {
+      if(EVP_PKEY_CTX_set_rsa_padding(key_ctx, RSA_PKCS1_PSS_PADDING) != 1)
+        return 0;
+
+      // BoringSSL does not define this, but -1 also forces a sale of the digest length
+      #ifndef RSA_PSS_SALTLEN_DIGEST
+        #define RSA_PSS_SALTLEN_DIGEST -1
+      #endif
+      if(EVP_PKEY_CTX_set_rsa_pss_saltlen(key_ctx, RSA_PSS_SALTLEN_DIGEST) != 1)
+        return 0;
+    }
+    else // PKCS1
+    {
+      if (EVP_PKEY_CTX_set_rsa_padding(key_ctx, RSA_PKCS1_PADDING) != 1)
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Initializes the signing contexts of all the algorithms usable with the key of cfg.
+// Contexts that cannot be duplicated (e.g. EdDSA with some OpenSSL versions) are
+// skipped, and initialized on each signature instead
+static int prepare_signing(config_entry *cfg)
+{
+  static const mipki_signature algs[] = {
+    0x0804, 0x0805, 0x0806, 0x0401, 0x0501, 0x0601, 0x0201,
+    0x0403, 0x0503, 0x0603, 0x0203, 0x0807 };
+  size_t n = sizeof(algs) / sizeof(algs[0]);
+
+  cfg->prepared = malloc(n * sizeof(prepared_sig));
+  cfg->prepared_len = 0;
+  if(!cfg->prepared) return 0;
+
+  for(size_t i = 0; i < n; i++)
+  {
+    if(!select_sigalg(cfg, algs + i, 1)) continue;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_MD_CTX *test = EVP_MD_CTX_new();
+    int ok = ctx && test && init_digest(ctx, cfg->key, algs[i], MIPKI_SIGN)
+      && EVP_MD_CTX_copy_ex(test, ctx) == 1;
+    EVP_MD_CTX_free(test);
+
+    if(!ok)
+    {
+      EVP_MD_CTX_free(ctx);
+      continue;
+    }
+
+    cfg->prepared[cfg->prepared_len].alg = algs[i];
+    cfg->prepared[cfg->prepared_len++].ctx = ctx;
+  }
+
+  return 1;
+}
+
 int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode)
 {
   assert(st != NULL);
@@ -430,47 +1029,16 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
     }
   }
 
-  EVP_PKEY_CTX* key_ctx = NULL;
-  DIGEST md = NULL;
   EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+  prepared_sig *p = NULL;
+  if(!md_ctx) return 0;
 
-  int kt = EVP_PKEY_type(EVP_PKEY_id(cfg->key));
-  if(!set_digest(sigalg, &md)) return 0;
-
-  #if DEBUG
-    printf("Using the message digest: %s\n", md ? OBJ_nid2sn(EVP_MD_type(md)) : "NULL");
-  #endif
+  for(size_t i = 0; mode == MIPKI_SIGN && i < cfg->prepared_len; i++)
+    if(cfg->prepared[i].alg == sigalg) p = cfg->prepared + i;
 
-  pfn_init init = (mode == MIPKI_SIGN ? EVP_DigestSignInit : EVP_DigestVerifyInit);
-  if(init(md_ctx, &key_ctx, md, NULL, cfg->key) != 1)
-  {
-    #if DEBUG
-      printf("mipki_sign_verify: failed to initialize DigestSign\n");
-    #endif
-    return 0;
-  }
-
-  // for RSA: set padding
-  if(kt == EVP_PKEY_RSA)
-  {
-    if(sigalg >> 8 == 8) // PSS
-    {
-      if(EVP_PKEY_CTX_set_rsa_padding(key_ctx, RSA_PKCS1_PSS_PADDING) != 1)
-        return 0;
-
-      // BoringSSL does not define this, but -1 also forces a sale of the digest length
-      #ifndef RSA_PSS_SALTLEN_DIGEST
-        #define RSA_PSS_SALTLEN_DIGEST -1
-      #endif
-      if(EVP_PKEY_CTX_set_rsa_pss_saltlen(key_ctx, RSA_PSS_SALTLEN_DIGEST) != 1)
-        return 0;
-    }
-    else // PKCS1
-    {
-      if (EVP_PKEY_CTX_set_rsa_padding(key_ctx, RSA_PKCS1_PADDING) != 1)
-        return 0;
-    }
-  }
+  if(p != NULL ? EVP_MD_CTX_copy_ex(md_ctx, p->ctx) != 1
+               : !init_digest(md_ctx, cfg->key, sigalg, mode))
+    goto done;
 
   if(mode == MIPKI_SIGN)
   {
@@ -499,8 +1067,113 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
     #endif
   }
 
-  EVP_MD_CTX_free(md_ctx);
-  return (ret == 1);
+  done:
+    EVP_MD_CTX_free(md_ctx);
+    return (ret == 1);
+}
+
+static POOL_WORKER(sign_worker)
+{
+  mipki_state *st = (mipki_state*)arg;
+
+  POOL_LOCK(st->jobs_lock);
+  while(1)
+  {
+    while(!st->jobs && !st->stopping)
+      POOL_WAIT(st->jobs_cond, st->jobs_lock);
+    if(!st->jobs) break; // stopping, and the queue is drained
+
+    sign_job *job = st->jobs;
+    st->jobs = job->next;
+    if(!st->jobs) st->jobs_tail = NULL;
+    POOL_UNLOCK(st->jobs_lock);
+
+    int ok = mipki_sign_verify(st, job->cfg, job->sigalg, job->tbs, job->tbs_len, job->sig, &job->sig_len, MIPKI_SIGN);
+    job->cb(job->cb_state, ok, ok ? job->sig_len : 0);
+    free(job->tbs);
+    free(job);
+
+    POOL_LOCK(st->jobs_lock);
+  }
+  POOL_UNLOCK(st->jobs_lock);
+  return 0;
+}
+
+int MITLS_CALLCONV mipki_start_sign_pool(mipki_state *st, unsigned threads)
+{
+  assert(st != NULL);
+  if(st->workers != NULL || threads == 0) return 0;
+
+  st->workers = malloc(threads * sizeof(mipki_thread));
+  if(!st->workers) return 0;
+  POOL_INIT(st->jobs_lock, st->jobs_cond);
+  st->jobs = st->jobs_tail = NULL;
+  st->stopping = 0;
+
+  for(st->workers_len = 0; st->workers_len < threads; st->workers_len++)
+  {
+    if(!POOL_START(st->workers[st->workers_len], sign_worker, st))
+    {
+      stop_sign_pool(st);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Signs the queued jobs, then joins the workers
+static void stop_sign_pool(mipki_state *st)
+{
+  if(st->workers == NULL) return;
+
+  POOL_LOCK(st->jobs_lock);
+  st->stopping = 1;
+  POOL_BROADCAST(st->jobs_cond);
+  POOL_UNLOCK(st->jobs_lock);
+
+  for(unsigned i = 0; i < st->workers_len; i++)
+    POOL_JOIN(st->workers[i]);
+
+  POOL_DESTROY(st->jobs_lock, st->jobs_cond);
+  free(st->workers);
+  st->workers = NULL;
+  st->workers_len = 0;
+}
+
+int MITLS_CALLCONV mipki_sign_async(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t sig_len, sign_callback cb, void *cb_state)
+{
+  assert(st != NULL);
+
+  if(st->workers == NULL)
+  {
+    int ok = mipki_sign_verify(st, cert_ptr, sigalg, tbs, tbs_len, sig, &sig_len, MIPKI_SIGN);
+    cb(cb_state, ok, ok ? sig_len : 0);
+    return 1;
+  }
+
+  sign_job *job = malloc(sizeof(sign_job));
+  char *copy = malloc(tbs_len ? tbs_len : 1);
+  if(!job || !copy)
+  {
+    free(job);
+    free(copy);
+    return 0;
+  }
+
+  memcpy(copy, tbs, tbs_len);
+  *job = (sign_job){
+    .cfg = (config_entry*)cert_ptr, .sigalg = sigalg,
+    .tbs = copy, .tbs_len = tbs_len, .sig = sig, .sig_len = sig_len,
+    .cb = cb, .cb_state = cb_state, .next = NULL };
+
+  POOL_LOCK(st->jobs_lock);
+  if(st->jobs_tail) st->jobs_tail->next = job;
+  else st->jobs = job;
+  st->jobs_tail = job;
+  POOL_SIGNAL(st->jobs_cond);
+  POOL_UNLOCK(st->jobs_lock);
+  return 1;
 }
 
 mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain, size_t chain_len)
@@ -513,8 +1186,13 @@ mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain,
     .endpoint = NULL,
     .intermediates = sk_X509_new_null(),
     .key = NULL,
+    .wire = NULL,
+    .wire_len = 0,
+    .prepared = NULL,
+    .prepared_len = 0,
     .is_universal = 0,
-    .is_ephemeral = 1
+    .is_ephemeral = 1,
+    .refs = 1
   };
 
   do {
@@ -587,8 +1265,13 @@ mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs,
     .endpoint = NULL,
     .intermediates = sk_X509_new_null(),
     .key = NULL,
+    .wire = NULL,
+    .wire_len = 0,
+    .prepared = NULL,
+    .prepared_len = 0,
     .is_universal = 0,
-    .is_ephemeral = 1
+    .is_ephemeral = 1,
+    .refs = 1
   };
 
   for(size_t i = 0; i < chain_len; i++)
@@ -626,84 +1309,86 @@ mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs,
     return NULL;
 }
 
-size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len)
+size_t MITLS_CALLCONV mipki_get_chain(mipki_state *st, mipki_chain chain, const char **buffer)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  char *cur = buffer;
-  char *end = buffer + buffer_len;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
+
+  // Configured chains are encoded by mipki_init; parsed chains
+  // belong to a single caller and are encoded on first use
+  if(cfg->wire == NULL && (!cfg->is_ephemeral || !encode_chain(cfg)))
+  {
+    *buffer = NULL;
+    return 0;
+  }
+
+  *buffer = cfg->wire;
+  return cfg->wire_len;
+}
+
+size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len)
+{
+  const char *wire;
+  size_t len = mipki_get_chain(st, chain, &wire);
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
+  if(len == 0 || len > buffer_len)
   {
-    unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
-
     #if DEBUG
-      char nb[256];
-      X509_NAME_oneline(X509_get_subject_name(x509), nb, 256);
-      printf(" - Adding: %s\n", nb);
+      printf("mipki_format_chain: chain does not fit in buffer.\n");
     #endif
-
-    int len = i2d_X509(x509, &buf);
-    if (len <= 0 || buf == NULL || cur + len + 3 > end)
-    {
-      #if DEBUG
-        printf("mipki_format_chain: i2d_X509 failed.\n");
-      #endif
-      sk_X509_shift(cfg->intermediates);
-      return 0;
-    }
-
-    *(cur++) = (len >> 16) & 0xFF;
-    *(cur++) = (len >> 8) & 0xFF;
-    *(cur++) = len & 0xFF;
-    memcpy(cur, buf, len);
-    cur += len;
-    OPENSSL_free(buf);
+    return 0;
   }
 
+  memcpy(buffer, wire, len);
+
   #if DEBUG
-    printf("Written %d bytes to chain buffer:\n", cur-buffer);
-    dump(buffer, cur - buffer);
+    printf("Written %d bytes to chain buffer:\n", (int)len);
+    dump((const unsigned char*)buffer, len);
   #endif
-  sk_X509_shift(cfg->intermediates);
-  return (cur - buffer);
+  return len;
+}
+
+void MITLS_CALLCONV mipki_format_slices(mipki_state *st, mipki_chain chain, void* init, slice_callback cb)
+{
+  const char *wire;
+  size_t len = mipki_get_chain(st, chain, &wire);
+  const unsigned char *cur = (const unsigned char*)wire;
+  const unsigned char *end = cur + len;
+  void* list = init;
+
+  while(end - cur > 3)
+  {
+    size_t cert_len = (cur[0]<<16) + (cur[1]<<8) + cur[2];
+    list = cb(list, (const char*)cur + 3, cert_len);
+    cur += 3 + cert_len;
+  }
 }
 
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb)
 {
-  assert(st != NULL);
-  config_entry *cfg = (config_entry*)chain;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
+  const char *wire;
+  size_t len = mipki_get_chain(st, chain, &wire);
+  const unsigned char *cur = (const unsigned char*)wire;
+  const unsigned char *end = cur + len;
   void* list = init;
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
+  while(end - cur > 3)
   {
-    unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
-
-    #if DEBUG
-      char nb[256];
-      X509_NAME_oneline(X509_get_subject_name(x509), nb, 256);
-      printf(" - Adding: %s\n", nb);
-    #endif
-
-    size_t len = i2d_X509(x509, NULL);
-    list = cb(list, len, (char**)&buf);
+    char *buf = NULL;
+    size_t cert_len = (cur[0]<<16) + (cur[1]<<8) + cur[2];
+    list = cb(list, cert_len, &buf);
     assert(buf != NULL);
-    i2d_X509(x509, &buf);
+    memcpy(buf, cur + 3, cert_len);
+    cur += 3 + cert_len;
   }
-
-  sk_X509_shift(cfg->intermediates);
 }
 
 #if DEBUG
@@ -728,18 +1413,26 @@ static void print_stack(STACK_OF(X509)* sk)
 }
 #endif
 
+// Validations run concurrently on the shared store, which is only read.
+// The host and flags are set on the parameters of each context, which are
+// initialized from the (default) parameters of the store.
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain, const char *host)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  X509_STORE_CTX *ctx = X509_STORE_CTX_new();
-  X509_VERIFY_PARAM *param = X509_VERIFY_PARAM_new();
+  X509_STORE_CTX *ctx = NULL;
+
+  POOL_LOCK(st->ctx_lock);
+  if(st->ctx_pool_len > 0) ctx = st->ctx_pool[--st->ctx_pool_len];
+  POOL_UNLOCK(st->ctx_lock);
 
-  if(!ctx || !param)
+  if(!ctx) ctx = X509_STORE_CTX_new();
+  if(!ctx || X509_STORE_CTX_init(ctx, st->store, cfg->endpoint, cfg->intermediates) != 1)
   {
     #if DEBUG
     printf("mipki_validate_chain: failed to initialize certificate validation context");
     #endif
+    X509_STORE_CTX_free(ctx);
     return 0;
   }
 
@@ -754,10 +1447,9 @@ int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain
   //flags |= X509_V_FLAG_CRL_CHECK;
   //flags |= X509_V_FLAG_USE_DELTAS;
 
+  X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
   X509_VERIFY_PARAM_set_flags(param, flags);
   X509_VERIFY_PARAM_set1_host(param, host, 0);
-  X509_STORE_set1_param(st->store, param);
-  X509_STORE_CTX_init(ctx, st->store, cfg->endpoint, cfg->intermediates);
 
   int r = X509_verify_cert(ctx);
   #if DEBUG
@@ -765,20 +1457,221 @@ int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain
     printf("mipki_validate_chain = %d [%s]\n", r, err);
   #endif
 
+  X509_STORE_CTX_cleanup(ctx);
+  POOL_LOCK(st->ctx_lock);
+  if(st->ctx_pool_len < MIPKI_STORE_CTX_POOL)
+  {
+    st->ctx_pool[st->ctx_pool_len++] = ctx;
+    ctx = NULL;
+  }
+  POOL_UNLOCK(st->ctx_lock);
   X509_STORE_CTX_free(ctx);
-  X509_VERIFY_PARAM_free(param);
+  return (r == 1);
+}
+
+static void cache_unlink(mipki_state *st, cache_entry *e)
+{
+  if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else st->lru_head = e->lru_next;
+  if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else st->lru_tail = e->lru_prev;
+}
+
+static void cache_push(mipki_state *st, cache_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = st->lru_head;
+  if(st->lru_head) st->lru_head->lru_prev = e;
+  else st->lru_tail = e;
+  st->lru_head = e;
+}
+
+static cache_entry **cache_bucket(mipki_state *st, const unsigned char key[32])
+{
+  size_t h;
+  memcpy(&h, key, sizeof(h));
+  return st->cache + (h & st->cache_mask);
+}
+
+static cache_entry *cache_find(mipki_state *st, const unsigned char key[32])
+{
+  for(cache_entry *e = *cache_bucket(st, key); e; e = e->next)
+    if(!memcmp(e->key, key, 32)) return e;
+  return NULL;
+}
+
+static void cache_remove(mipki_state *st, cache_entry *e)
+{
+  cache_entry **b = cache_bucket(st, e->key);
+  while(*b != e) b = &(*b)->next;
+  *b = e->next;
+  cache_unlink(st, e);
+  st->cache_len--;
+  mipki_free_chain(st, e->chain);
+  free(e);
+}
+
+static void cache_clear(mipki_state *st)
+{
+  while(st->lru_head) cache_remove(st, st->lru_head);
+}
+
+int MITLS_CALLCONV mipki_set_validation_cache(mipki_state *st, size_t entries)
+{
+  assert(st != NULL);
+  size_t size = 16;
+  while(size < 2 * entries) size <<= 1;
+
+  cache_clear(st);
+  free(st->cache);
+  st->cache = NULL;
+  st->cache_max = 0;
+  if(entries == 0) return 1;
+
+  st->cache = calloc(size, sizeof(cache_entry*));
+  if(!st->cache) return 0;
+  st->cache_mask = size - 1;
+  st->cache_max = entries;
+  return 1;
+}
+
+// SHA-256 of the length-prefixed certificates and host
+static int cache_key(const char **certs, const size_t *certs_len, size_t chain_len, const char *host, unsigned char key[32])
+{
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  unsigned char len[4];
+  int r = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+  for(size_t i = 0; r && i <= chain_len; i++)
+  {
+    const char *b = (i < chain_len) ? certs[i] : (host ? host : "");
+    size_t l = (i < chain_len) ? certs_len[i] : strlen(b);
+    len[0] = l >> 24; len[1] = l >> 16; len[2] = l >> 8; len[3] = l;
+    r = EVP_DigestUpdate(ctx, len, 4) && EVP_DigestUpdate(ctx, b, l);
+  }
+
+  r = r && EVP_DigestFinal_ex(ctx, key, NULL);
+  EVP_MD_CTX_free(ctx);
   return r;
 }
 
+// The earliest expiration of the certificates of a valid chain, within MIPKI_CACHE_TTL
+static time_t chain_expiry(config_entry *cfg, time_t now)
+{
+  time_t expires = now + MIPKI_CACHE_TTL;
+  int days, secs;
+
+  for(int i = -1; i < sk_X509_num(cfg->intermediates); i++)
+  {
+    X509 *x509 = i < 0 ? cfg->endpoint : sk_X509_value(cfg->intermediates, i);
+    if(!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(x509))) return now;
+    time_t left = (time_t)days * 86400 + secs; // days * 86400 overflows an int after 68 years
+    if(left < expires - now) expires = now + left;
+  }
+
+  return expires;
+}
+
+mipki_chain MITLS_CALLCONV mipki_parse_list_validated(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len, const char *host, int *valid)
+{
+  assert(st != NULL);
+  unsigned char key[32];
+  time_t now = time(NULL);
+  int cached = st->cache_max > 0 && cache_key(certs, certs_len, chain_len, host, key);
+
+  if(cached)
+  {
+    POOL_LOCK(st->cache_lock);
+    cache_entry *e = cache_find(st, key);
+    if(e && e->expires > now)
+    {
+      #if DEBUG
+        printf("mipki_parse_list_validated: cached result %d\n", e->valid);
+      #endif
+      config_entry *chain = e->chain;
+      REF_INCREMENT(&chain->refs);
+      *valid = e->valid;
+      cache_unlink(st, e);
+      cache_push(st, e);
+      POOL_UNLOCK(st->cache_lock);
+      return chain;
+    }
+    if(e) cache_remove(st, e); // expired
+    POOL_UNLOCK(st->cache_lock);
+  }
+
+  config_entry *chain = (config_entry*)mipki_parse_list(st, certs, certs_len, chain_len);
+  if(!chain) return NULL;
+  *valid = mipki_validate_chain(st, chain, host);
+
+  // Shared chains are encoded before they are published
+  cache_entry *e = cached && encode_chain(chain) ? malloc(sizeof(cache_entry)) : NULL;
+  if(!e) return chain;
+
+  memcpy(e->key, key, 32);
+  e->chain = chain;
+  e->valid = *valid;
+  e->expires = *valid ? chain_expiry(chain, now) : now + MIPKI_CACHE_TTL;
+  REF_INCREMENT(&chain->refs);
+
+  POOL_LOCK(st->cache_lock);
+  if(cache_find(st, key) == NULL) // unless added concurrently
+  {
+    if(st->cache_len == st->cache_max) cache_remove(st, st->lru_tail);
+    cache_entry **b = cache_bucket(st, key);
+    e->next = *b;
+    *b = e;
+    cache_push(st, e);
+    st->cache_len++;
+    e = NULL;
+  }
+  POOL_UNLOCK(st->cache_lock);
+
+  if(e)
+  {
+    REF_DECREMENT(&chain->refs);
+    free(e);
+  }
+  return chain;
+}
+
+mipki_chain MITLS_CALLCONV mipki_parse_chain_validated(mipki_state *st, const char *chain, size_t chain_len, const char *host, int *valid)
+{
+  const char *certs[MIPKI_CACHE_MAX_CERTS];
+  size_t certs_len[MIPKI_CACHE_MAX_CERTS];
+  const unsigned char *cur = (const unsigned char*)chain;
+  const unsigned char *end = cur + chain_len;
+  size_t n = 0;
+
+  while(end - cur >= 3 && n < MIPKI_CACHE_MAX_CERTS)
+  {
+    size_t len = (cur[0]<<16) + (cur[1]<<8) + cur[2];
+    if(len > (size_t)(end - cur - 3)) return NULL;
+    certs[n] = (const char*)cur + 3;
+    certs_len[n++] = len;
+    cur += 3 + len;
+  }
+
+  if(cur == end && n > 0)
+    return mipki_parse_list_validated(st, certs, certs_len, n, host, valid);
+
+  // Not cached
+  mipki_chain res = mipki_parse_chain(st, chain, chain_len);
+  if(res) *valid = mipki_validate_chain(st, res, host);
+  return res;
+}
+
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
   if(cfg == NULL || !cfg->is_ephemeral) return;
+  if(REF_DECREMENT(&cfg->refs) > 0) return; // still cached or in use
 
   X509_free(cfg->endpoint);
   EVP_PKEY_free(cfg->key);
   sk_X509_pop_free(cfg->intermediates, X509_free);
+  free(cfg->wire);
 
   free(cfg);
 }
@@ -796,14 +1689,26 @@ void D() {};
 
 void MITLS_CALLCONV mipki_free(mipki_state *st) { D(); }
 mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx) { D(); return NULL; }
+mipki_state* MITLS_CALLCONV mipki_init_ex(const mipki_config_entry config[], size_t config_len, password_callback pcb, const mipki_init_options *opts, int *erridx) { D(); return NULL; }
+mipki_current* MITLS_CALLCONV mipki_current_new(mipki_state *st) { D(); return NULL; }
+mipki_state* MITLS_CALLCONV mipki_acquire(mipki_current *cur) { D(); return NULL; }
+void MITLS_CALLCONV mipki_swap(mipki_current *cur, mipki_state *next) { D(); }
+void MITLS_CALLCONV mipki_current_free(mipki_current *cur) { D(); }
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file) { D(); return 0; }
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected) { D(); return NULL; }
 int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode) { D(); return 0; }
+int MITLS_CALLCONV mipki_start_sign_pool(mipki_state *st, unsigned threads) { D(); return 0; }
+int MITLS_CALLCONV mipki_sign_async(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t sig_len, sign_callback cb, void *cb_state) { D(); return 0; }
 mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain, size_t chain_len) { D(); return NULL; }
 mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len) { D(); return NULL; }
+size_t MITLS_CALLCONV mipki_get_chain(mipki_state *st, mipki_chain chain, const char **buffer) { D(); *buffer = NULL; return 0; }
 size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len) { D(); return 0; }
+void MITLS_CALLCONV mipki_format_slices(mipki_state *st, mipki_chain chain, void* init, slice_callback cb) { D(); }
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb) { D(); }
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain, const char *host) { D(); return 0; }
+int MITLS_CALLCONV mipki_set_validation_cache(mipki_state *st, size_t entries) { D(); return 0; }
+mipki_chain MITLS_CALLCONV mipki_parse_chain_validated(mipki_state *st, const char *chain, size_t chain_len, const char *host, int *valid) { D(); return NULL; }
+mipki_chain MITLS_CALLCONV mipki_parse_list_validated(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len, const char *host, int *valid) { D(); return NULL; }
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain) { D(); }
 
 #endif
@@ -50,16 +50,54 @@ typedef int (MITLS_CALLCONV *password_callback)(char *pass, int max_size, const
 // A callback to allocate a new buffer to write the chain element to
 typedef void* (MITLS_CALLCONV *alloc_callback)(void* cur, size_t len, /*out*/ char **buf);
 
+// A callback receiving each DER certificate of a chain, in place
+typedef void* (MITLS_CALLCONV *slice_callback)(void* cur, const char *cert, size_t len);
+
 // Create a new instance of the PKI library using the provided server configuration
 // The configuration describes the selectable certificates as a server, and
 // their private keys. They are loaded in memory until mipki_free is called.
 // The created instance may be used in multiple TLS connections, for instance,
 // it is recommanded to share the mipki_state accoress incoming connections on a server
 mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx);
+
+// Release a reference to the state (mipki_init and mipki_acquire each return one),
+// freeing it once no longer referenced
 void MITLS_CALLCONV mipki_free(mipki_state *st);
 
+// Reports that loaded of the total configuration entries are loaded, elapsed_ms after the start of mipki_init_ex
+typedef void (MITLS_CALLCONV *progress_callback)(void *cb_state, size_t loaded, size_t total, uint64_t elapsed_ms);
+
+typedef struct {
+  unsigned threads;           // Number of loader threads, including the calling thread
+  progress_callback progress; // Optional, called from loader threads, and once all entries are loaded
+  void *progress_state;
+  size_t progress_interval;   // Report progress every progress_interval entries (0 for only once done)
+} mipki_init_options;
+
+// As mipki_init, loading the keys and chains of the configuration in parallel.
+// The password callback may be called concurrently from the loader threads.
+// On error, *erridx is the first entry that failed to load.
+mipki_state* MITLS_CALLCONV mipki_init_ex(const mipki_config_entry config[], size_t config_len, password_callback pcb, const mipki_init_options *opts, int *erridx);
+
+// Certificate rotation: a server keeps the state of its current configuration in a
+// mipki_current, and each new connection uses the state returned by mipki_acquire,
+// released with mipki_free when the connection is closed. mipki_swap replaces the
+// current state with a fully initialized one (including its roots): new connections
+// use it immediately, while connections in progress complete with the previous state,
+// which is freed by the last of them. The validation cache is not carried over.
+typedef struct mipki_current mipki_current;
+
+// Takes over the reference to st
+mipki_current* MITLS_CALLCONV mipki_current_new(mipki_state *st);
+mipki_state* MITLS_CALLCONV mipki_acquire(mipki_current *cur);
+
+// Takes over the reference to next, and releases the previous state
+void MITLS_CALLCONV mipki_swap(mipki_current *cur, mipki_state *next);
+void MITLS_CALLCONV mipki_current_free(mipki_current *cur);
+
 // OpenSSL specific: configure a root certificate file or hash directory.
-// This is mandatory to perform certificate chain validation
+// This is mandatory to perform certificate chain validation, and must be done
+// before validating chains: the root store is shared by concurrent validations
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file);
 
 // Find a certificate and signature algorithm compatible with the given SNI and list of offered signature algorithms
@@ -72,6 +110,19 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
 // input signature length.
 int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode m);
 
+// Optional pool of signing threads, which sign the requests of mipki_sign_async
+// while the calling threads process other connections. Returns 0 on error.
+// The threads are stopped by mipki_free, after signing the queued requests
+int MITLS_CALLCONV mipki_start_sign_pool(mipki_state *st, unsigned threads);
+
+// Called with ok != 0 and the size of the signature, or ok = 0 if signing failed
+typedef void (MITLS_CALLCONV *sign_callback)(void *cb_state, int ok, size_t sig_len);
+
+// Queue the signature of tbs (which is copied) into sig, of size sig_len, and call cb
+// from a pool thread once done. sig must remain valid until cb is called.
+// Without a pool, signs and calls cb before returning. Returns 0 if the request was not queued
+int MITLS_CALLCONV mipki_sign_async(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t sig_len, sign_callback cb, void *cb_state);
+
 // Parse a chain in TLS network format into an abstract chain object
 // Each certificate in the chain is encoded in DER, prefixed with the size of the
 // DER-encodeded structure over 3 bytes. The returned chain must be freed after use
@@ -80,15 +131,35 @@ mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain,
 // Parse an array of DER certificates into a chain object
 mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len);
 
+// Get the TLS network format of a chain, which is computed once by mipki_init for
+// configured chains. The returned buffer is read-only, may be shared by concurrent
+// connections, and remains valid until mipki_free (or mipki_free_chain for parsed chains)
+size_t MITLS_CALLCONV mipki_get_chain(mipki_state *st, mipki_chain chain, /*out*/ const char **buffer);
+
 // Format an abstract chain into the TLS network format
 size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, mipki_chain chain, char *buffer, size_t buffer_len);
 
+// Call cb on each DER certificate of the chain, pointing into the buffer of mipki_get_chain
+void MITLS_CALLCONV mipki_format_slices(mipki_state *st, mipki_chain chain, void* init, slice_callback cb);
+
 // Format an abstract chain into a list of buffers allocated with a callback function
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb);
 
 // Certificate chain validation. This checks revocation, expiration, and matches the hostname
+// May be called concurrently, including with different hosts
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, mipki_chain chain, const char *host);
 
+// Parse a chain (as mipki_parse_chain or mipki_parse_list) and validate it for host (as
+// mipki_validate_chain, with the result in *valid). Recent results are kept in a cache keyed
+// by a hash of the chain and host, until the chain expires or for at most an hour; cached chains
+// are shared, and must be freed with mipki_free_chain after use
+mipki_chain MITLS_CALLCONV mipki_parse_chain_validated(mipki_state *st, const char *chain, size_t chain_len, const char *host, /*out*/ int *valid);
+mipki_chain MITLS_CALLCONV mipki_parse_list_validated(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len, const char *host, /*out*/ int *valid);
+
+// Set the number of entries of the validation cache (256 by default, 0 disables the cache)
+// This clears the cache, and must not be called concurrently with validations
+int MITLS_CALLCONV mipki_set_validation_cache(mipki_state *st, size_t entries);
+
 // Free a chain after use.
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain);
 
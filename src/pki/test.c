@@ -14,6 +14,23 @@ static void dump(const unsigned char *buffer, size_t len)
   }
 }
 
+typedef struct { int ok; size_t len; } async_result;
+
+static void MITLS_CALLCONV async_done(void *cb_state, int ok, size_t sig_len)
+{
+  async_result *r = (async_result*)cb_state;
+  r->ok = ok;
+  r->len = sig_len;
+}
+
+static size_t loaded = 0;
+
+static void MITLS_CALLCONV progress(void *cb_state, size_t done, size_t total, uint64_t elapsed_ms)
+{
+  *(size_t*)cb_state = done;
+  printf("Loaded %d/%d entries in %dms\n", (int)done, (int)total, (int)elapsed_ms);
+}
+
 int main(int argc, char **argv)
 {
   mipki_config_entry config[1] = {
@@ -103,9 +120,100 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  const char *wire;
+  if(mipki_get_chain(st, s, &wire) != len || memcmp(wire, sig, len))
+  {
+    printf("ERROR: formatted chain differs from the chain image\n");
+    return 1;
+  }
+
+  // A repeated chain is validated once, and shared until freed
+  int valid1 = -1, valid2 = -1;
+  mipki_chain c1 = mipki_parse_chain_validated(st, sig, len, "localhost", &valid1);
+  mipki_chain c2 = mipki_parse_chain_validated(st, sig, len, "localhost", &valid2);
+  if(!c1 || c1 != c2 || valid1 != valid2)
+  {
+    printf("ERROR: validation cache miss\n");
+    return 1;
+  }
+  mipki_free_chain(st, c1);
+  mipki_free_chain(st, c2);
+  printf("Validation cache OK.\n");
+
+  // PKCS1 signatures are deterministic: the pool must produce the same signature
+  char *sig1 = malloc(8192), *sig2 = malloc(8192);
+  size_t sig1_len = 8192;
+  async_result r = {0, 0};
+  if(!mipki_sign_verify(st, s, 0x0401, tbs, strlen(tbs), sig1, &sig1_len, MIPKI_SIGN)
+     || !mipki_start_sign_pool(st, 2)
+     || !mipki_sign_async(st, s, 0x0401, tbs, strlen(tbs), sig2, 8192, async_done, &r))
+  {
+    printf("ERROR: failed to queue signature\n");
+    return 1;
+  }
+
   mipki_free_chain(st, s);
   free(sig);
-  mipki_free(st);
+  mipki_free(st); // waits for the queued signature
+
+  if(!r.ok || r.len != sig1_len || memcmp(sig1, sig2, sig1_len))
+  {
+    printf("ERROR: signature from the signing pool differs\n");
+    return 1;
+  }
+  printf("Signing pool OK.\n");
+  free(sig1);
+  free(sig2);
+
+  // Parallel loading of several entries, the last of which is missing
+  mipki_config_entry many[4] = { config[0], config[0], config[0], config[0] };
+  many[3].key_file = "../../data/missing.key";
+  mipki_init_options opts = { .threads = 3, .progress = progress, .progress_state = &loaded };
+
+  if(mipki_init_ex(many, 4, NULL, &opts, &erridx) || erridx != 3)
+  {
+    printf("ERROR: expected parallel loading to fail on entry 3, got %d\n", erridx);
+    return 1;
+  }
+
+  if(!(st = mipki_init_ex(many, 3, NULL, &opts, &erridx)) || loaded != 3)
+  {
+    printf("ERROR: parallel loading failed on entry %d\n", erridx);
+    return 1;
+  }
+  printf("Parallel loading OK.\n");
+
+  // Rotation: a connection in progress keeps the state it acquired
+  mipki_current *cur = mipki_current_new(st);
+  mipki_state *conn = mipki_acquire(cur);
+  mipki_state *next = mipki_init(config, 1, NULL, &erridx);
+  if(!cur || conn != st || !next)
+  {
+    printf("ERROR: failed to set up rotation\n");
+    return 1;
+  }
+
+  mipki_swap(cur, next);
+  s = mipki_select_certificate(conn, "localhost", 9, offered, 3, &selected);
+  size_t slen = 8192;
+  sig = malloc(slen);
+  if(!s || !mipki_sign_verify(conn, s, selected, tbs, strlen(tbs), sig, &slen, MIPKI_SIGN))
+  {
+    printf("ERROR: previous state unusable after swap\n");
+    return 1;
+  }
+  free(sig);
+  mipki_free(conn); // frees st
+
+  conn = mipki_acquire(cur);
+  if(conn != next)
+  {
+    printf("ERROR: new connections do not use the swapped state\n");
+    return 1;
+  }
+  mipki_free(conn);
+  mipki_current_free(cur);
+  printf("Rotation OK.\n");
 
   return 0;
 }
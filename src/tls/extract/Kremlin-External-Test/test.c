@@ -0,0 +1,379 @@
+// An external test of libmitls, through "mitlsffi.h" only: a TLS 1.3
+// client and server connected by a socket pair, in two threads.
+//
+// The client sends a message gathered from buffers of assorted sizes
+// with FFI_mitls_sendv, and the server reads it back with
+// FFI_mitls_receive_copy into a buffer smaller than a record.
+//
+// Then a client and a server driven by FFI_mitls_process exchange their
+// records through memory buffers, in one thread, fed a few bytes at a
+// time into output and data buffers smaller than a record.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mitlsffi.h"
+#include "mipki.h"
+
+#define HOST "ecdsa.cert.mitls.org"
+#define MAX_FRAGMENT 16384
+
+// Sizes of the buffers of the message: some records are within a buffer,
+// others span several of them, including an empty one
+static const size_t sizes[] = { 1, 16383, 5, 0, 20000, 7, 32768, 16384, 3 };
+#define COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static mipki_state *pki;
+
+typedef struct {
+  int fd;
+  int counting; // count the records in the output of the client
+  size_t sends;
+  size_t records;
+} transport;
+
+static int MITLS_CALLCONV send_cb(void *ctx, const unsigned char *buffer, size_t buffer_size)
+{
+  transport *t = (transport*)ctx;
+  if (t->counting) {
+    size_t pos = 0;
+    t->sends++;
+    while (pos + 5 <= buffer_size) {
+      pos += 5 + ((size_t)buffer[pos + 3] << 8 | buffer[pos + 4]);
+      t->records++;
+    }
+  }
+  size_t sent = 0;
+  while (sent < buffer_size) {
+    ssize_t r = send(t->fd, buffer + sent, buffer_size - sent, 0);
+    if (r <= 0) return -1;
+    sent += (size_t)r;
+  }
+  return (int)sent;
+}
+
+static int MITLS_CALLCONV recv_cb(void *ctx, unsigned char *buffer, size_t buffer_size)
+{
+  transport *t = (transport*)ctx;
+  ssize_t r = recv(t->fd, buffer, buffer_size, MSG_WAITALL);
+  return (int)r;
+}
+
+static void* MITLS_CALLCONV cert_select(void *cbs, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected)
+{
+  return (void*)mipki_select_certificate((mipki_state*)cbs, (const char*)sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t MITLS_CALLCONV cert_format(void *cbs, const void *cert_ptr, unsigned char *buffer)
+{
+  return mipki_format_chain((mipki_state*)cbs, (mipki_chain)cert_ptr, (char*)buffer, MAX_CHAIN_LEN);
+}
+
+// Servers send the chain in place, from the image kept by mipki
+static size_t MITLS_CALLCONV cert_get_chain(void *cbs, const void *cert_ptr, const unsigned char **chain)
+{
+  return mipki_get_chain((mipki_state*)cbs, (mipki_chain)cert_ptr, (const char**)chain);
+}
+
+static size_t MITLS_CALLCONV cert_sign(void *cbs, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+  size_t ret = MAX_SIGNATURE_LEN;
+  if (mipki_sign_verify((mipki_state*)cbs, cert_ptr, sigalg, (const char*)tbs, tbs_len, (char*)sig, &ret, MIPKI_SIGN))
+    return ret;
+  return 0;
+}
+
+// The test certificates may have expired: only the signature is checked
+static int MITLS_CALLCONV cert_verify(void *cbs, const unsigned char *chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  int valid = 0;
+  mipki_chain chain = mipki_parse_chain_validated(st, (const char*)chain_bytes, chain_len, HOST, &valid);
+  if (chain == NULL) return 0;
+  size_t slen = sig_len;
+  int r = mipki_sign_verify(st, chain, sigalg, (const char*)tbs, tbs_len, (char*)sig, &slen, MIPKI_VERIFY);
+  mipki_free_chain(st, chain);
+  return r;
+}
+
+static mitls_state *configure(const char *host)
+{
+  mitls_state *state = NULL;
+  mitls_cert_cb cb = { .select = cert_select, .format = cert_format, .sign = cert_sign, .verify = cert_verify };
+  if (!FFI_mitls_configure(&state, "1.3", host)) return NULL;
+  if (!FFI_mitls_configure_cert_callbacks(state, pki, &cb)
+      || (host == NULL && !FFI_mitls_configure_cert_get_chain(state, cert_get_chain))) {
+    FFI_mitls_close(state);
+    return NULL;
+  }
+  return state;
+}
+
+static unsigned char *message;
+static size_t message_len;
+
+static void *server(void *arg)
+{
+  transport *t = (transport*)arg;
+  mitls_state *state = configure(NULL);
+  unsigned char buffer[1000];
+  unsigned char *received = malloc(message_len);
+  size_t len = 0;
+  intptr_t ok = 0;
+
+  if (state && received && FFI_mitls_accept_connected(t, send_cb, recv_cb, state)) {
+    while (len < message_len) {
+      size_t n = 0;
+      if (!FFI_mitls_receive_copy(state, buffer, sizeof(buffer), &n)) break;
+      if (n > message_len - len) break;
+      memcpy(received + len, buffer, n);
+      len += n;
+    }
+    ok = (len == message_len && memcmp(received, message, message_len) == 0);
+    if (!ok) printf("server: received %u of %u bytes, or not the ones sent\n", (unsigned)len, (unsigned)message_len);
+  } else {
+    printf("server: handshake failed\n");
+  }
+  free(received);
+  FFI_mitls_close(state);
+  return (void*)ok;
+}
+
+static int client(transport *t)
+{
+  mitls_iovec iov[COUNT];
+  size_t i, pos = 0;
+  int ok = 0;
+  mitls_state *state = configure(HOST);
+
+  for (i = 0; i < COUNT; i++) {
+    iov[i].iov_base = message + pos;
+    iov[i].iov_len = sizes[i];
+    pos += sizes[i];
+  }
+
+  if (state && FFI_mitls_connect(t, send_cb, recv_cb, state)) {
+    t->counting = 1;
+    ok = FFI_mitls_sendv(state, iov, COUNT);
+    t->counting = 0;
+    if (!ok) printf("client: FFI_mitls_sendv failed\n");
+  } else {
+    printf("client: handshake failed\n");
+  }
+
+  // Full-size records, passed to the send callback at once
+  size_t records = (message_len + MAX_FRAGMENT - 1) / MAX_FRAGMENT;
+  if (ok && (t->sends != 1 || t->records != records)) {
+    printf("client: %u records in %u sends, expected %u in 1\n", (unsigned)t->records, (unsigned)t->sends, (unsigned)records);
+    ok = 0;
+  }
+  FFI_mitls_close(state);
+  return ok;
+}
+
+// Bytes passed to each FFI_mitls_process call: input is cut mid-record,
+// and output and data are left over for the next calls
+#define FEED 700
+#define OUTPUT 300
+#define DATA 1000
+#define NB_MESSAGE 5000
+
+typedef struct {
+  const char *name;
+  mitls_state *state;
+  unsigned char *in; // records from the peer, not yet consumed
+  size_t in_len;
+  unsigned char *data; // application data received
+  size_t data_len;
+  uint16_t flags;
+  uint16_t tls_error;
+  int output_left; // to_be_written was set at least once
+  int data_left;   // TFLAG_DATA_PENDING was set at least once
+} endpoint;
+
+// One FFI_mitls_process call on e, appending its output to the input of peer
+static int step(endpoint *e, endpoint *peer)
+{
+  unsigned char output[OUTPUT], data[DATA];
+  mitls_process_ctx ctx = {
+    .input = e->in, .input_len = e->in_len < FEED ? e->in_len : FEED,
+    .output = output, .output_len = sizeof(output),
+    .data = data, .data_len = sizeof(data) };
+  size_t input_len = ctx.input_len;
+
+  int r = FFI_mitls_process(e->state, &ctx);
+  e->flags = ctx.flags;
+  e->tls_error = ctx.tls_error;
+  if (!r) return 0;
+  if (ctx.consumed_bytes > input_len || ctx.output_len > sizeof(output) || ctx.data_len > sizeof(data)) {
+    printf("%s: FFI_mitls_process overran a buffer\n", e->name);
+    return 0;
+  }
+  if ((ctx.to_be_read != 0) != ((ctx.flags & TFLAG_DATA_PENDING) != 0)) {
+    printf("%s: to_be_read is %u but TFLAG_DATA_PENDING is %s\n", e->name,
+      (unsigned)ctx.to_be_read, (ctx.flags & TFLAG_DATA_PENDING) ? "set" : "clear");
+    return 0;
+  }
+  e->output_left |= (ctx.to_be_written != 0);
+  e->data_left |= (ctx.to_be_read != 0);
+
+  memmove(e->in, e->in + ctx.consumed_bytes, e->in_len - ctx.consumed_bytes);
+  e->in_len -= ctx.consumed_bytes;
+  memcpy(peer->in + peer->in_len, output, ctx.output_len);
+  peer->in_len += ctx.output_len;
+  if (e->data_len + ctx.data_len > NB_MESSAGE) {
+    printf("%s: received too much data\n", e->name);
+    return 0;
+  }
+  memcpy(e->data + e->data_len, data, ctx.data_len);
+  e->data_len += ctx.data_len;
+  return 1;
+}
+
+static int endpoint_init(endpoint *e, const char *name, const char *host, int is_server)
+{
+  memset(e, 0, sizeof(*e));
+  e->name = name;
+  e->in = malloc(4 * MAX_FRAGMENT + NB_MESSAGE);
+  e->data = malloc(NB_MESSAGE);
+  e->state = configure(host);
+  return e->in && e->data && e->state && FFI_mitls_process_start(e->state, is_server);
+}
+
+static void endpoint_free(endpoint *e)
+{
+  FFI_mitls_close(e->state);
+  free(e->in);
+  free(e->data);
+}
+
+// Steps the client and the server in turn, until done holds or neither
+// makes progress
+static int exchange(endpoint *c, endpoint *s, int (*done)(endpoint *, endpoint *))
+{
+  int idle = 0;
+  while (!done(c, s) && idle < 4) {
+    size_t before = c->in_len + s->in_len + c->data_len + s->data_len;
+    if (!step(c, s) || !step(s, c)) return 0;
+    idle = (c->in_len + s->in_len + c->data_len + s->data_len == before) ? idle + 1 : 0;
+  }
+  return done(c, s);
+}
+
+static int handshake_done(endpoint *c, endpoint *s)
+{
+  return (c->flags & TFLAG_COMPLETE) && (s->flags & TFLAG_COMPLETE);
+}
+
+static int message_received(endpoint *c, endpoint *s)
+{
+  return s->data_len == NB_MESSAGE && !(s->flags & TFLAG_DATA_PENDING);
+}
+
+static int non_blocking(void)
+{
+  endpoint c, s;
+  int ok = 0;
+
+  if (!(endpoint_init(&c, "client", HOST, 0) & endpoint_init(&s, "server", NULL, 1))) {
+    printf("non-blocking: configuration failed\n");
+  } else if (!exchange(&c, &s, handshake_done)) {
+    printf("non-blocking: handshake failed (client flags %x, error %x; server flags %x, error %x)\n",
+      c.flags, c.tls_error, s.flags, s.tls_error);
+  } else if (!FFI_mitls_send(c.state, message, NB_MESSAGE) || !exchange(&c, &s, message_received)) {
+    printf("non-blocking: the server received %u of %u bytes\n", (unsigned)s.data_len, (unsigned)NB_MESSAGE);
+  } else if (memcmp(s.data, message, NB_MESSAGE) != 0) {
+    printf("non-blocking: the server received other bytes than those sent\n");
+  } else if (!c.output_left || !s.data_left) {
+    printf("non-blocking: output or data were never left over for the next call\n");
+  } else if (!FFI_mitls_send(c.state, message, 100) || !step(&c, &s) || s.in_len == 0) {
+    printf("non-blocking: the client failed to send\n");
+  } else {
+    // A record corrupted on the way fails the connection with an alert
+    s.in[s.in_len - 1] ^= 1;
+    if (step(&s, &c) || s.tls_error == 0) {
+      printf("non-blocking: the server accepted a corrupted record\n");
+    } else {
+      ok = 1;
+    }
+  }
+  endpoint_free(&c);
+  endpoint_free(&s);
+
+  // Processing fails without FFI_mitls_process_start
+  mitls_state *state = configure(HOST);
+  mitls_process_ctx ctx = { .input = NULL };
+  if (state == NULL || FFI_mitls_process(state, &ctx) || ctx.tls_error == 0) {
+    printf("non-blocking: processed a connection that was not started\n");
+    ok = 0;
+  }
+  FFI_mitls_close(state);
+
+  // A connection may be closed mid-handshake
+  if (!(endpoint_init(&c, "client", HOST, 0) & endpoint_init(&s, "server", NULL, 1))
+      || !step(&c, &s) || s.in_len == 0 || (c.flags & TFLAG_COMPLETE)) {
+    printf("non-blocking: the client sent no ClientHello\n");
+    ok = 0;
+  }
+  endpoint_free(&c);
+  endpoint_free(&s);
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  const char *data = argc > 1 ? argv[1] : "../../../../data";
+  char cert[512], key[512], ca[512];
+  int fds[2], erridx;
+  size_t i;
+
+  snprintf(cert, sizeof(cert), "%s/server-ecdsa.crt", data);
+  snprintf(key, sizeof(key), "%s/server-ecdsa.key", data);
+  snprintf(ca, sizeof(ca), "%s/CAFile.pem", data);
+  mipki_config_entry config[1] = { { .cert_file = cert, .key_file = key, .is_universal = 1 } };
+
+  if (!FFI_mitls_init()) {
+    printf("FFI_mitls_init failed\n");
+    return 1;
+  }
+  pki = mipki_init(config, 1, NULL, &erridx);
+  if (pki == NULL || !mipki_add_root_file_or_path(pki, ca)) {
+    printf("Failed to load %s\n", data);
+    return 1;
+  }
+
+  for (i = 0; i < COUNT; i++) message_len += sizes[i];
+  message = malloc(message_len);
+  for (i = 0; i < message_len; i++) message[i] = (unsigned char)(i * 7 + i / 251);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    printf("socketpair failed\n");
+    return 1;
+  }
+  transport ct = { .fd = fds[0] }, st = { .fd = fds[1] };
+  pthread_t th;
+  void *server_ok = NULL;
+  pthread_create(&th, NULL, server, &st);
+  int client_ok = client(&ct);
+  shutdown(fds[0], SHUT_RDWR);
+  pthread_join(th, &server_ok);
+  close(fds[0]);
+  close(fds[1]);
+
+  int non_blocking_ok = non_blocking();
+
+  free(message);
+  mipki_free(pki);
+  FFI_mitls_cleanup();
+
+  if (!client_ok || !server_ok || !non_blocking_ok) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK: %u bytes in %u buffers, and %u bytes without blocking\n", (unsigned)message_len, (unsigned)COUNT, (unsigned)NB_MESSAGE);
+  return 0;
+}
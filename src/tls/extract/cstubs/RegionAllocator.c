@@ -52,6 +52,13 @@ void PrintRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
     KRML_HOST_PRINTF("========\n");
 }
 
+int GetRegionStatistics(region_statistics *stats, size_t *current_bytes, size_t *peak_bytes)
+{
+    *current_bytes = stats->current_bytes;
+    *peak_bytes = stats->peak_bytes;
+    return 1;
+}
+
 void UpdateStatisticsAfterMalloc(region_statistics *stats, void *pv, size_t cb)
 {
     stats->allocation_count++;
@@ -75,6 +82,7 @@ void UpdateStatisticsAfterFree(region_statistics *stats, size_t cb)
 #define UpdateStatisticsAfterMalloc(stats, pv, cb)
 #define UpdateStatisticsAfterFree(stats, cb)
 #define PrintRegionStatistics(rgn, stats)
+#define GetRegionStatistics(stats, current_bytes, peak_bytes) 0
 
 #endif
 
@@ -156,6 +164,20 @@ void HeapRegionDestroy(HEAP_REGION rgn)
     HeapDestroy(h);
 }
 
+// The region record lives in its own heap, which cannot be emptied in place
+int HeapRegionReset(HEAP_REGION rgn)
+{
+    return 0;
+}
+
+void HeapRegionSetPoolSize(unsigned int max_regions)
+{
+}
+
+void HeapRegionReleasePool(void)
+{
+}
+
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
@@ -165,6 +187,15 @@ void PrintHeapRegionStatistics(HEAP_REGION rgn)
     PrintRegionStatistics(heap, &heap->stats);
 }
 
+int HeapRegionGetStatistics(HEAP_REGION rgn, size_t *current_bytes, size_t *peak_bytes)
+{
+    region *heap = (region*)rgn;
+    if (heap == NULL) {
+        heap = &g_global_region;
+    }
+    return GetRegionStatistics(&heap->stats, current_bytes, peak_bytes);
+}
+
 HEAP_REGION HeapRegionEnter(HEAP_REGION rgn
 #if !defined(_MSC_VER)
   , jmp_buf *penv
@@ -189,6 +220,11 @@ void HeapRegionLeave(HEAP_REGION oldrgn)
     TlsSetValue(g_region_heap_slot, oldrgn);
 }
 
+HEAP_REGION HeapRegionCurrent(void)
+{
+    return TlsGetValue(g_region_heap_slot);
+}
+
 // KRML_HOST_MALLOC
 void* HeapRegionMalloc(size_t cb)
 {
@@ -246,7 +282,18 @@ void HeapRegionFree(void* pv)
 pthread_key_t g_region_heap_slot;
 pthread_mutex_t g_global_region_lock; 
 
+// Regions other than the global one are arenas: small allocations are
+// carved out of large chunks with a bump pointer, and destroying the
+// region frees whole chunks. Larger allocations, and all allocations in
+// the global region, are malloc'd and linked into the region's list.
+#ifndef REGION_CHUNK_SIZE
+#define REGION_CHUNK_SIZE 16384
+#endif
+#define REGION_LARGE_ALLOCATION (REGION_CHUNK_SIZE/4)
+
 typedef struct region_allocation {
+    // For arena allocations, le_prev is NULL and le_next holds the
+    // size of the allocation, header included
     LIST_ENTRY(region_allocation) entry;
 #if REGION_STATISTICS
     size_t cb;
@@ -254,8 +301,16 @@ typedef struct region_allocation {
 #endif
 } region_allocation;
 
+typedef struct region_chunk {
+    struct region_chunk *next;
+    size_t size; // bytes available after the header
+    size_t used; // bytes allocated after the header
+    size_t pad;  // pad so this size is a multiple of 16 on 64-bit machines
+} region_chunk;
+
 typedef struct region {
     LIST_HEAD(region_allocation_list, region_allocation) entries;
+    region_chunk *chunks; // most recent first
     jmp_buf *penv;
 #if REGION_STATISTICS
     region_statistics stats;
@@ -264,6 +319,31 @@ typedef struct region {
 
 region g_global_region; // All allocations made at global scope go here
 
+// Destroyed regions are reset and kept in a per-thread pool, so that the
+// next region created on the thread reuses their first chunk.
+#ifndef REGION_POOL_MAX
+#define REGION_POOL_MAX 16
+#endif
+
+typedef struct region_pool {
+    unsigned int count;
+    region *regions[REGION_POOL_MAX];
+} region_pool;
+
+pthread_key_t g_region_pool_slot;
+unsigned int g_region_pool_size = 4;
+
+static void FreeRegion(region *p);
+
+static void RegionPoolDestructor(void *pv)
+{
+    region_pool *pool = (region_pool*)pv;
+    while (pool->count) {
+        FreeRegion(pool->regions[--pool->count]);
+    }
+    free(pool);
+}
+
 // Global initialization  
 // returns 0 for error, nonzero for success
 int HeapRegionInitialize()
@@ -275,6 +355,11 @@ int HeapRegionInitialize()
         pthread_mutex_destroy(&g_global_region_lock);
         return 0;
     }
+    if (pthread_key_create(&g_region_pool_slot, RegionPoolDestructor) != 0) {
+        pthread_key_delete(g_region_heap_slot);
+        pthread_mutex_destroy(&g_global_region_lock);
+        return 0;
+    }
     memset(&g_global_region, 0, sizeof(g_global_region));
     LIST_INIT(&g_global_region.entries);
     return 1;
@@ -283,19 +368,43 @@ int HeapRegionInitialize()
 // Global termination
 void HeapRegionCleanup(void)
 {
+    HeapRegionReleasePool();
     HeapRegionDestroy((HEAP_REGION)&g_global_region);
+    pthread_key_delete(g_region_pool_slot);
     pthread_key_delete(g_region_heap_slot);
     pthread_mutex_destroy(&g_global_region_lock);
 }
 
+void HeapRegionSetPoolSize(unsigned int max_regions)
+{
+    g_region_pool_size = (max_regions < REGION_POOL_MAX) ? max_regions : REGION_POOL_MAX;
+}
+
+void HeapRegionReleasePool(void)
+{
+    region_pool *pool = (region_pool*)pthread_getspecific(g_region_pool_slot);
+    if (pool) {
+        pthread_setspecific(g_region_pool_slot, NULL);
+        RegionPoolDestructor(pool);
+    }
+}
+
 // Create a new region and make it this thread's default
 HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn, jmp_buf *penv)
 {
     HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
-    region *p = malloc(sizeof(region));
+    region_pool *pool = (region_pool*)pthread_getspecific(g_region_pool_slot);
+    region *p;
+    if (pool && pool->count) {
+        p = pool->regions[--pool->count];
+    } else {
+        p = malloc(sizeof(region));
+        if (p) {
+            memset(p, 0, sizeof(region));
+            LIST_INIT(&p->entries);
+        }
+    }
     if (p) {
-        memset(p, 0, sizeof(region));
-        LIST_INIT(&p->entries);
         p->penv = penv;
         pthread_setspecific(g_region_heap_slot, p);
     }
@@ -303,25 +412,64 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn, jmp_buf *penv)
     return oldrgn;
 }
 
-// Destroy a region and free all of its memory
-void HeapRegionDestroy(HEAP_REGION rgn)
+// Free all of the allocations in a region, keeping its oldest chunk
+int HeapRegionReset(HEAP_REGION rgn)
 {
-    pthread_setspecific(g_region_heap_slot, NULL);
-    
-    // Free all of the entries in the linked-list
-    region *p = (region *)rgn;   
-    PrintRegionStatistics(p, &p->stats);
+    region *p = (region *)rgn;
+    while (p->chunks && p->chunks->next) {
+        region_chunk *c = p->chunks;
+        p->chunks = c->next;
+        free(c);
+    }
+    if (p->chunks) {
+        p->chunks->used = 0;
+    }
     while (p->entries.lh_first) {
         struct region_allocation *a = p->entries.lh_first;
         LIST_REMOVE(a, entry);
         free(a);
     }
+#if REGION_STATISTICS
+    memset(&p->stats, 0, sizeof(p->stats));
+#endif
+    return 1;
+}
+
+static void FreeRegion(region *p)
+{
+    HeapRegionReset((HEAP_REGION)p);
+    free(p->chunks);
+    p->chunks = NULL;
     if (p != &g_global_region) {
         // Then free the list head itself
         free(p);
     }
 }
 
+// Destroy a region and free all of its memory, or keep it for reuse
+void HeapRegionDestroy(HEAP_REGION rgn)
+{
+    pthread_setspecific(g_region_heap_slot, NULL);
+    
+    region *p = (region *)rgn;   
+    PrintRegionStatistics(p, &p->stats);
+    if (p != &g_global_region && g_region_pool_size) {
+        region_pool *pool = (region_pool*)pthread_getspecific(g_region_pool_slot);
+        if (pool == NULL) {
+            pool = calloc(1, sizeof(region_pool));
+            if (pool) {
+                pthread_setspecific(g_region_pool_slot, pool);
+            }
+        }
+        if (pool && pool->count < g_region_pool_size) {
+            HeapRegionReset(rgn);
+            pool->regions[pool->count++] = p;
+            return;
+        }
+    }
+    FreeRegion(p);
+}
+
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
@@ -331,6 +479,15 @@ void PrintHeapRegionStatistics(HEAP_REGION rgn)
     PrintRegionStatistics(heap, &heap->stats);
 }
 
+int HeapRegionGetStatistics(HEAP_REGION rgn, size_t *current_bytes, size_t *peak_bytes)
+{
+    region *heap = (region*)rgn;
+    if (heap == NULL) {
+        heap = &g_global_region;
+    }
+    return GetRegionStatistics(&heap->stats, current_bytes, peak_bytes);
+}
+
 HEAP_REGION HeapRegionEnter(HEAP_REGION rgn, jmp_buf *penv)
 {
     HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
@@ -349,6 +506,44 @@ void HeapRegionLeave(HEAP_REGION oldrgn)
     pthread_setspecific(g_region_heap_slot, oldrgn);
 }
 
+HEAP_REGION HeapRegionCurrent(void)
+{
+    return (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
+}
+
+// Bump-allocate actual_cb bytes (header included) from the region's arena
+static region_allocation *ArenaMalloc(region *heap, size_t actual_cb)
+{
+    actual_cb = (actual_cb + 15) & ~(size_t)15;
+    region_chunk *c = heap->chunks;
+    if (c == NULL || c->size - c->used < actual_cb) {
+        c = malloc(sizeof(region_chunk) + REGION_CHUNK_SIZE);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = heap->chunks;
+        c->size = REGION_CHUNK_SIZE;
+        c->used = 0;
+        heap->chunks = c;
+    }
+    region_allocation *e = (region_allocation*)((char*)(c + 1) + c->used);
+    c->used += actual_cb;
+    e->entry.le_prev = NULL;
+    e->entry.le_next = (region_allocation*)actual_cb;
+    return e;
+}
+
+// Arena allocations are reclaimed with their region; only the most
+// recent one can be returned to its chunk early.
+static void ArenaFree(region *heap, region_allocation *e)
+{
+    size_t actual_cb = (size_t)e->entry.le_next;
+    region_chunk *c = (heap == NULL) ? NULL : heap->chunks;
+    if (c && (char*)e + actual_cb == (char*)(c + 1) + c->used) {
+        c->used -= actual_cb;
+    }
+}
+
 // KRML_HOST_MALLOC
 void* HeapRegionMalloc(size_t cb)
 {
@@ -356,26 +551,38 @@ void* HeapRegionMalloc(size_t cb)
     if (actual_cb < cb) {
         return NULL; // Integer overflow
     }
-    void *pv = malloc(actual_cb);
     region *heap = (region *)pthread_getspecific(g_region_heap_slot);
-    if (pv) {
-        struct region_allocation *e = (struct region_allocation*)pv;
+    struct region_allocation *e;
+    if (heap != NULL && actual_cb <= REGION_LARGE_ALLOCATION) {
+        e = ArenaMalloc(heap, actual_cb);
+        if (e) {
+            UpdateStatisticsAfterMalloc(&heap->stats, e, cb);
+        }
+    } else {
+        e = (struct region_allocation*)malloc(actual_cb);
+        if (e) {
+            if (heap == NULL) {
+                pthread_mutex_lock(&g_global_region_lock);
+                LIST_INSERT_HEAD(&g_global_region.entries, e, entry);
+                UpdateStatisticsAfterMalloc(&g_global_region.stats, e, cb);
+                pthread_mutex_unlock(&g_global_region_lock);
+            } else {
+                UpdateStatisticsAfterMalloc(&heap->stats, e, cb);
+                LIST_INSERT_HEAD(&heap->entries, e, entry);
+            }
+        }
+    }
+    if (e) {
 #if REGION_STATISTICS
         e->cb = cb;
 #endif
-        if (heap == NULL) {
-            pthread_mutex_lock(&g_global_region_lock);
-            LIST_INSERT_HEAD(&g_global_region.entries, e, entry);
-            UpdateStatisticsAfterMalloc(&g_global_region.stats, pv, cb);
-            pthread_mutex_unlock(&g_global_region_lock);
-        } else {
-            UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
-            LIST_INSERT_HEAD(&heap->entries, e, entry);
-        }
-        return (void*)(e + 1); // Return the address of the byte following the LIST_ENTRY
+        return (void*)(e + 1); // Return the address of the byte following the header
     }
     else {
-        UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+        if (heap == NULL) {
+            heap = &g_global_region;
+        }
+        UpdateStatisticsAfterMalloc(&heap->stats, NULL, cb);
         longjmp(*heap->penv, 1);
         return NULL;
     }
@@ -403,6 +610,13 @@ void HeapRegionFree(void* pv)
     }
     region_allocation *e = ((region_allocation*)pv - 1);
     region *heap = (region*)pthread_getspecific(g_region_heap_slot);
+    if (e->entry.le_prev == NULL) {
+        if (heap != NULL) {
+            UpdateStatisticsAfterFree(&heap->stats, e->cb);
+        }
+        ArenaFree(heap, e);
+        return;
+    }
     if (heap == NULL) {
         pthread_mutex_lock(&g_global_region_lock);
         LIST_REMOVE(e, entry);
@@ -480,6 +694,28 @@ void HeapRegionDestroy(HEAP_REGION rgn)
     }
 }
 
+// Free all of the entries in the linked-list, keeping the list head
+int HeapRegionReset(HEAP_REGION rgn)
+{
+    region *heap = (region*)rgn;
+    while (!IsListEmpty(&heap->entries)) {
+        LIST_ENTRY *a = RemoveHeadList(&heap->entries);
+        ExFreePoolWithTag(a, MITLS_TAG);
+    }
+#if REGION_STATISTICS
+    RtlZeroMemory(&heap->stats, sizeof(heap->stats));
+#endif
+    return 1;
+}
+
+void HeapRegionSetPoolSize(unsigned int max_regions)
+{
+}
+
+void HeapRegionReleasePool(void)
+{
+}
+
 // Create a new region-based heap and register it as the current region
 void HeapRegionCreateAndRegister(region_entry* pe, HEAP_REGION *prgn)
 {
@@ -536,6 +772,15 @@ void PrintHeapRegionStatistics(HEAP_REGION rgn)
     PrintRegionStatistics(heap, &heap->stats);
 }
 
+int HeapRegionGetStatistics(HEAP_REGION rgn, size_t *current_bytes, size_t *peak_bytes)
+{
+    region *heap = (region*)rgn;
+    if (heap == NULL) {
+        heap = &g_global_region;
+    }
+    return GetRegionStatistics(&heap->stats, current_bytes, peak_bytes);
+}
+
 // KRML_HOST_MALLOC
 void* HeapRegionMalloc(size_t cb)
 {
@@ -666,6 +911,24 @@ void HeapRegionCleanup(void)
 {
 }
 
+int HeapRegionReset(HEAP_REGION rgn)
+{
+    return 0;
+}
+
+void HeapRegionSetPoolSize(unsigned int max_regions)
+{
+}
+
+void HeapRegionReleasePool(void)
+{
+}
+
+int HeapRegionGetStatistics(HEAP_REGION rgn, size_t *current_bytes, size_t *peak_bytes)
+{
+    return 0;
+}
+
 // KRML_HOST_MALLOC/CALLOC/FREE plug-ins
 void* HeapRegionMalloc(size_t cb)
 {
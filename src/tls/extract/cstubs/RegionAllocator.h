@@ -6,7 +6,9 @@ This file has multiple compilation options:
 1.  Choice of region-based heap:
     - USE_HEAP_REGIONS - use region-based heaps in usermode.  On Windows, this
       leverages a separate heap instance per region, via CreateHeap().  On Linux,
-      this manages a per-region linked-list of allocations made via malloc().
+      small allocations are carved out of per-region chunks, and larger ones
+      are kept in a per-region linked-list of allocations made via malloc().
+      Destroyed regions are recycled through a per-thread pool.
     - USE_KERNEL_REGIONS - Windows only.  Manage a per-region linked list of
       allocations made via ExAllocatePoolWithTag().
     - default... no-op.  All allocations are made without region tracking.
@@ -30,6 +32,23 @@ void HeapRegionCleanup(void);
 
 void PrintHeapRegionStatistics(HEAP_REGION rgn);
 
+// Get the bytes currently allocated in a region (NULL for the default region),
+// and their peak. returns 0 if the allocator keeps no REGION_STATISTICS
+int HeapRegionGetStatistics(HEAP_REGION rgn, size_t *current_bytes, size_t *peak_bytes);
+
+// Free all of the allocations in a region, keeping the region itself (and,
+// where supported, some of its memory) for further allocations.
+// returns 0 if regions cannot be reset in this configuration
+int HeapRegionReset(HEAP_REGION rgn);
+
+// Keep up to max_regions destroyed regions per thread, reset, to be reused
+// by the next regions created on that thread. Only USE_HEAP_REGIONS on
+// non-Windows platforms has a pool; elsewhere, these are no-ops.
+void HeapRegionSetPoolSize(unsigned int max_regions);
+
+// Free the calling thread's pool (also done when the thread exits)
+void HeapRegionReleasePool(void);
+
 // KRML_HOST_MALLOC/CALLOC/FREE plug-ins
 void* HeapRegionMalloc(size_t cb);
 void* HeapRegionCalloc(size_t num, size_t size);
@@ -107,6 +126,10 @@ void HeapRegionFree(void* pv);
 void HeapRegionLeave(HEAP_REGION oldrgn);
 void HeapRegionDestroy(HEAP_REGION rgn);
 
+// The region entered by the calling thread, NULL for the default region
+HEAP_REGION HeapRegionCurrent(void);
+#define CURRENT_HEAP_REGION() HeapRegionCurrent()
+
 #elif USE_KERNEL_REGIONS
 // Use regions managed within the kernel pool.  All unfreed allocations within
 // the region will be freed when the region is destroyed.  A default region
@@ -181,6 +204,7 @@ void HeapRegionDestroy(HEAP_REGION rgn);
 #define CREATE_HEAP_REGION(prgn) *(prgn)=NULL
 #define VALID_HEAP_REGION(rgn) TRUE
 #define DESTROY_HEAP_REGION(rgn)
+#define CURRENT_HEAP_REGION() NULL
 #define HAD_OUT_OF_MEMORY 0
 
 #endif // !USE_HEAP_REGIONS && !USE_KERNEL_REGIONS
@@ -0,0 +1,459 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "EverCrypt.h"
+#include "mitlsffi.h"
+
+// Native implementation of KeyPool.fsti
+//
+// One ring of single-use shares per pooled group, refilled by
+// low-priority worker threads and popped by the handshakes. Workers
+// generate outside of the lock; the shares are copied to the connection
+// that pops them, and erased from the ring. As in locks.c, the state is
+// statically initialized, and the pools are empty until
+// FFI_mitls_configure_key_pool starts the workers.
+//
+// An FFDHE share keeps its private exponent in an EverCrypt state, which
+// cannot be copied. Each one is generated in a heap region of its own;
+// popping it hands the state to the connection, and its region is
+// destroyed with the connection's (see KeyPool_release). The parameters
+// of an FFDHE group are registered by its first pop, so its pool only
+// fills once a connection has used the group.
+
+#define X25519 0x001d
+#define X25519_LEN 64 // public point, then secret scalar
+#define MAX_THREADS 16
+
+#if IS_WINDOWS && defined(_KERNEL_MODE)
+
+// No worker threads in kernel mode: the pools stay empty
+void KeyPool_configure(unsigned threads, const mitls_key_pool_group *groups, size_t count)
+{
+}
+
+void KeyPool_release(HEAP_REGION owner)
+{
+}
+
+FStar_Bytes_bytes KeyPool_pop_x25519(void)
+{
+  return FStar_Bytes_empty_bytes;
+}
+
+EverCrypt_dh_state_s *KeyPool_pop_ffdhe(uint16_t id,
+  uint8_t *p, uint32_t p_len, uint8_t *g, uint32_t g_len, uint8_t *q, uint32_t q_len,
+  uint8_t *pub, uint32_t *pub_len)
+{
+  *pub_len = 0;
+  return NULL;
+}
+
+#else
+
+#if IS_WINDOWS
+  typedef SRWLOCK pool_lock;
+  typedef CONDITION_VARIABLE pool_cond;
+  typedef HANDLE pool_thread;
+  #define LOCK(x) AcquireSRWLockExclusive(&x)
+  #define UNLOCK(x) ReleaseSRWLockExclusive(&x)
+  #define WAIT(c, x) SleepConditionVariableSRW(&c, &x, INFINITE, 0)
+  #define SIGNAL(c) WakeConditionVariable(&c)
+  #define BROADCAST(c) WakeAllConditionVariable(&c)
+  #define LOCK_INITIALIZER SRWLOCK_INIT
+  #define COND_INITIALIZER CONDITION_VARIABLE_INIT
+  #define WORKER(f) static DWORD WINAPI f(LPVOID arg)
+  #define WORKER_RETURN return 0
+  static int start_worker(pool_thread *t, LPTHREAD_START_ROUTINE f)
+  {
+    *t = CreateThread(NULL, 0, f, NULL, 0, NULL);
+    if(*t == NULL) return 0;
+    SetThreadPriority(*t, THREAD_PRIORITY_BELOW_NORMAL);
+    return 1;
+  }
+  static void join_worker(pool_thread t)
+  {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+  }
+#else
+  typedef pthread_mutex_t pool_lock;
+  typedef pthread_cond_t pool_cond;
+  typedef pthread_t pool_thread;
+  #define LOCK(x) pthread_mutex_lock(&x)
+  #define UNLOCK(x) pthread_mutex_unlock(&x)
+  #define WAIT(c, x) pthread_cond_wait(&c, &x)
+  #define SIGNAL(c) pthread_cond_signal(&c)
+  #define BROADCAST(c) pthread_cond_broadcast(&c)
+  #define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+  #define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+  #define WORKER(f) static void *f(void *arg)
+  #define WORKER_RETURN return NULL
+  static int start_worker(pool_thread *t, void *(*f)(void*))
+  {
+    return pthread_create(t, NULL, f, NULL) == 0;
+  }
+  static void join_worker(pool_thread t)
+  {
+    pthread_join(t, NULL);
+  }
+#endif
+
+static pool_lock lock = LOCK_INITIALIZER;
+static pool_cond not_full = COND_INITIALIZER;
+
+// Serializes KeyPool_configure, which waits for the workers
+static pool_lock configure_lock = LOCK_INITIALIZER;
+
+typedef struct {
+  uint8_t key[X25519_LEN];    // X25519
+  uint8_t *pub;               // FFDHE public value, of pub_len bytes
+  uint32_t pub_len;
+  EverCrypt_dh_state_s *st;   // FFDHE, holds the private exponent
+  HEAP_REGION rgn;            // FFDHE, where st is allocated
+} share;
+
+typedef struct {
+  uint16_t id;                // TLS code point of the group
+  unsigned depth, head, count;
+  unsigned pending;           // shares being generated by the workers
+  share *ring;
+  uint8_t *params;            // FFDHE p, g and q, NULL until registered
+  uint32_t p_len, g_len, q_len;
+} pool;
+
+#define POOLS 6
+static pool pools[POOLS] = {
+  { .id = X25519 },
+  { .id = 0x0100 }, { .id = 0x0101 }, { .id = 0x0102 }, { .id = 0x0103 }, { .id = 0x0104 }
+};
+
+// FFDHE shares popped by a connection, released with its region
+typedef struct taken_share {
+  HEAP_REGION owner;
+  HEAP_REGION rgn;
+  struct taken_share *next;
+} taken_share;
+static taken_share *taken;
+
+static int stopping;
+static unsigned next_pool;
+static pool_thread workers[MAX_THREADS];
+static unsigned running;
+
+// Cleared with volatile stores, which the compiler cannot drop
+static void wipe(uint8_t *b, size_t len)
+{
+  volatile uint8_t *v = b;
+  while(len--) *v++ = 0;
+}
+
+static pool *find_pool(uint16_t id)
+{
+  for(unsigned i = 0; i < POOLS; i++)
+    if(pools[i].id == id) return &pools[i];
+  return NULL;
+}
+
+// Called under the lock: a pool with room for one more share, in turn
+static pool *pool_to_fill(void)
+{
+  for(unsigned i = 0; i < POOLS; i++)
+  {
+    pool *p = &pools[(next_pool + i) % POOLS];
+    if(p->count + p->pending < p->depth && (p->id == X25519 || p->params != NULL))
+    {
+      next_pool = (next_pool + i + 1) % POOLS;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static void free_share(share *s)
+{
+  wipe(s->key, X25519_LEN);
+  free(s->pub);
+  s->pub = NULL;
+  if(s->st != NULL)
+  {
+    DESTROY_HEAP_REGION(s->rgn);
+    s->st = NULL;
+  }
+}
+
+// Called outside of the lock; the parameters of p do not change while
+// the workers run
+static int generate(pool *p, share *s)
+{
+  if(p->id == X25519)
+  {
+    uint8_t base_point[32] = {9};
+    EverCrypt_random_sample(32, s->key + 32);
+    EverCrypt_Curve25519_ecdh(s->key, s->key + 32, base_point);
+    return 1;
+  }
+
+  uint8_t *g = p->params + p->p_len, *q = g + p->g_len;
+  HEAP_REGION rgn;
+  s->pub = malloc(p->p_len);
+  if(s->pub == NULL) return 0;
+
+  CREATE_HEAP_REGION(&rgn);
+  if(VALID_HEAP_REGION(rgn))
+  {
+    s->st = EverCrypt_dh_load_group(p->params, p->p_len, g, p->g_len, q, p->q_len);
+    s->pub_len = EverCrypt_dh_keygen(s->st, s->pub);
+  }
+  LEAVE_HEAP_REGION();
+  if(!VALID_HEAP_REGION(rgn) || HAD_OUT_OF_MEMORY || s->pub_len == 0)
+  {
+    if(VALID_HEAP_REGION(rgn))
+    {
+      DESTROY_HEAP_REGION(rgn);
+    }
+    free(s->pub);
+    s->pub = NULL;
+    s->st = NULL;
+    return 0;
+  }
+  s->rgn = rgn;
+  return 1;
+}
+
+WORKER(refill)
+{
+  (void)arg;
+
+  #if !IS_WINDOWS && defined(SCHED_IDLE)
+  struct sched_param sp = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+  #endif
+
+  LOCK(lock);
+  while(!stopping)
+  {
+    pool *p = pool_to_fill();
+    if(p == NULL)
+    {
+      WAIT(not_full, lock);
+      continue;
+    }
+
+    // The slot is reserved, so that workers do not generate shares for
+    // the same room
+    share s = {0};
+    p->pending++;
+    UNLOCK(lock);
+    int ok = generate(p, &s);
+    LOCK(lock);
+    p->pending--;
+
+    if(ok && !stopping)
+    {
+      p->ring[(p->head + p->count) % p->depth] = s;
+      p->count++;
+      wipe(s.key, X25519_LEN);
+    }
+    else if(ok)
+    {
+      free_share(&s);
+    }
+  }
+  UNLOCK(lock);
+  WORKER_RETURN;
+}
+
+void KeyPool_configure(unsigned threads, const mitls_key_pool_group *groups, size_t count)
+{
+  LOCK(configure_lock);
+
+  // Stop the current workers and erase their shares
+  LOCK(lock);
+  stopping = 1;
+  BROADCAST(not_full);
+  UNLOCK(lock);
+  for(unsigned i = 0; i < running; i++)
+    join_worker(workers[i]);
+  running = 0;
+
+  int any = 0;
+  LOCK(lock);
+  for(unsigned i = 0; i < POOLS; i++)
+  {
+    pool *p = &pools[i];
+    for(unsigned j = 0; j < p->count; j++)
+      free_share(&p->ring[(p->head + j) % p->depth]);
+    free(p->ring);
+    p->ring = NULL;
+    p->depth = p->head = p->count = 0;
+  }
+  stopping = 0;
+
+  if(threads > MAX_THREADS) threads = MAX_THREADS;
+  for(size_t i = 0; threads && i < count; i++)
+  {
+    pool *p = find_pool(groups[i].group);
+    unsigned d = groups[i].depth;
+    if(p == NULL || d == 0 || p->ring != NULL) continue;
+    if((p->ring = calloc(d, sizeof(share))) != NULL)
+    {
+      p->depth = d;
+      any = 1;
+    }
+  }
+  UNLOCK(lock);
+
+  if(any)
+  {
+    while(running < threads && start_worker(&workers[running], refill))
+      running++;
+  }
+
+  UNLOCK(configure_lock);
+}
+
+void KeyPool_release(HEAP_REGION owner)
+{
+  taken_share *l = NULL, **t;
+
+  LOCK(lock);
+  for(t = &taken; *t != NULL; )
+  {
+    taken_share *e = *t;
+    if(e->owner == owner)
+    {
+      *t = e->next;
+      e->next = l;
+      l = e;
+    }
+    else t = &e->next;
+  }
+  UNLOCK(lock);
+
+  while(l != NULL)
+  {
+    taken_share *e = l;
+    l = e->next;
+    DESTROY_HEAP_REGION(e->rgn);
+    free(e);
+  }
+}
+
+FStar_Bytes_bytes KeyPool_pop_x25519(void)
+{
+  pool *p = &pools[0];
+  share s;
+  int found = 0;
+
+  LOCK(lock);
+  if(p->count)
+  {
+    s = p->ring[p->head];
+    wipe(p->ring[p->head].key, X25519_LEN);
+    p->head = (p->head + 1) % p->depth;
+    p->count--;
+    found = 1;
+    SIGNAL(not_full);
+  }
+  UNLOCK(lock);
+
+  if(!found) return FStar_Bytes_empty_bytes;
+
+  // Copied outside of the lock, as KRML_HOST_MALLOC may not return
+  char *data = KRML_HOST_MALLOC(X25519_LEN);
+  if(!data)
+  {
+    KRML_HOST_EXIT(255);
+  }
+  memcpy(data, s.key, X25519_LEN);
+  wipe(s.key, X25519_LEN);
+
+  FStar_Bytes_bytes r = {.length = X25519_LEN, .data = data};
+  return r;
+}
+
+static int same_params(const pool *p, const uint8_t *pp, uint32_t p_len,
+  const uint8_t *g, uint32_t g_len, const uint8_t *q, uint32_t q_len)
+{
+  return p->p_len == p_len && p->g_len == g_len && p->q_len == q_len
+    && memcmp(p->params, pp, p_len) == 0
+    && memcmp(p->params + p_len, g, g_len) == 0
+    && memcmp(p->params + p_len + g_len, q, q_len) == 0;
+}
+
+EverCrypt_dh_state_s *KeyPool_pop_ffdhe(uint16_t id,
+  uint8_t *pp, uint32_t p_len, uint8_t *g, uint32_t g_len, uint8_t *q, uint32_t q_len,
+  uint8_t *pub, uint32_t *pub_len)
+{
+  pool *p = find_pool(id);
+  taken_share *t = malloc(sizeof(taken_share));
+  share s;
+  int found = 0;
+
+  *pub_len = 0;
+  if(p == NULL || p->id == X25519 || t == NULL)
+  {
+    free(t);
+    return NULL;
+  }
+
+  LOCK(lock);
+  if(p->params == NULL)
+  {
+    // Registered for good, so that the workers can fill the pool
+    size_t len = (size_t)p_len + g_len + q_len;
+    if((p->params = malloc(len)) != NULL)
+    {
+      memcpy(p->params, pp, p_len);
+      memcpy(p->params + p_len, g, g_len);
+      memcpy(p->params + p_len + g_len, q, q_len);
+      p->p_len = p_len;
+      p->g_len = g_len;
+      p->q_len = q_len;
+      BROADCAST(not_full);
+    }
+  }
+  else if(p->count && same_params(p, pp, p_len, g, g_len, q, q_len))
+  {
+    s = p->ring[p->head];
+    p->ring[p->head].pub = NULL;
+    p->ring[p->head].st = NULL;
+    p->head = (p->head + 1) % p->depth;
+    p->count--;
+    found = 1;
+    SIGNAL(not_full);
+
+    // Outside of any region (the default mode), the state is never
+    // freed, as for the states DHGroup loads itself
+    t->owner = CURRENT_HEAP_REGION();
+    if(t->owner != NULL)
+    {
+      t->rgn = s.rgn;
+      t->next = taken;
+      taken = t;
+      t = NULL;
+    }
+  }
+  UNLOCK(lock);
+
+  free(t);
+  if(!found) return NULL;
+  memcpy(pub, s.pub, s.pub_len);
+  *pub_len = s.pub_len;
+  free(s.pub);
+  return s.st;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+
+// Native implementation of Locks.fsti
+//
+// All locks are statically initialized, so that they are usable from
+// kremlinit_globals and from the internal tests, which do not go
+// through FFI_mitls_init.
+
+#if IS_WINDOWS
+  #ifdef _KERNEL_MODE
+    // A zeroed push lock is a valid, unowned push lock
+    static EX_PUSH_LOCK keys_lock;
+    static EX_PUSH_LOCK tables_lock;
+    #define LOCK(x) ExfAcquirePushLockExclusive(&x)
+    #define UNLOCK(x) ExfReleasePushLockExclusive(&x)
+  #else
+    static SRWLOCK keys_lock = SRWLOCK_INIT;
+    static SRWLOCK tables_lock = SRWLOCK_INIT;
+    #define LOCK(x) AcquireSRWLockExclusive(&x)
+    #define UNLOCK(x) ReleaseSRWLockExclusive(&x)
+  #endif
+  #define STORE_RELEASE(x, v) InterlockedExchangePointer((PVOID volatile *)(x), v)
+  #define LOAD_ACQUIRE(x) InterlockedCompareExchangePointer((PVOID volatile *)(x), NULL, NULL)
+#else
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK(x) pthread_mutex_lock(&x)
+#define UNLOCK(x) pthread_mutex_unlock(&x)
+#define STORE_RELEASE(x, v) __atomic_store_n(x, v, __ATOMIC_RELEASE)
+#define LOAD_ACQUIRE(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+#endif
+
+// The key rings of Ticket (ticket keys, then sealing keys), NULL until
+// the first key is published
+static void *volatile key_rings[2];
+
+void Locks_lock_keys(void)
+{
+  LOCK(keys_lock);
+}
+
+void Locks_unlock_keys(void)
+{
+  UNLOCK(keys_lock);
+}
+
+bool Locks_keys_published(bool sealing)
+{
+  return LOAD_ACQUIRE(&key_rings[sealing ? 1 : 0]) != NULL;
+}
+
+FStar_Dyn_dyn Locks_load_keys(bool sealing)
+{
+  return LOAD_ACQUIRE(&key_rings[sealing ? 1 : 0]);
+}
+
+void Locks_publish_keys(bool sealing, FStar_Dyn_dyn ring)
+{
+  STORE_RELEASE(&key_rings[sealing ? 1 : 0], ring);
+}
+
+void Locks_lock_tables(void)
+{
+  LOCK(tables_lock);
+}
+
+void Locks_unlock_tables(void)
+{
+  UNLOCK(tables_lock);
+}
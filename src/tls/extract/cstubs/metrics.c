@@ -0,0 +1,254 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Process-wide handshake metrics of FFI_mitls_get_global_metrics
+//
+// Every counter is a 64-bit word updated with an atomic add, so that
+// connections never wait on each other. A code point takes the first
+// free slot of its table with a compare-and-swap on the key of the
+// slot (the code point + 1, 0 when free), and keeps it for the life of
+// the process; once the table is full, new code points are counted in
+// its last slot. Latencies are timed with Stats_clock, and are not
+// recorded in kernel mode, where it returns 0.
+
+#if IS_WINDOWS
+#define ADD(x, n) InterlockedExchangeAdd64((volatile LONG64*)(x), (LONG64)(n))
+#define LOAD(x) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(x), 0, 0))
+#define KEY_LOAD(x) ((uint32_t)InterlockedCompareExchange((volatile LONG*)(x), 0, 0))
+#define KEY_CLAIM(x, k) (InterlockedCompareExchange((volatile LONG*)(x), (LONG)(k), 0) == 0)
+#else
+#define ADD(x, n) __atomic_fetch_add(x, (uint64_t)(n), __ATOMIC_RELAXED)
+#define LOAD(x) __atomic_load_n(x, __ATOMIC_RELAXED)
+#define KEY_LOAD(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+static int key_claim(volatile uint32_t *x, uint32_t k)
+{
+  uint32_t free_key = 0;
+  return __atomic_compare_exchange_n(x, &free_key, k, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#define KEY_CLAIM(x, k) key_claim(x, k)
+#endif
+
+// Implemented in stats.c, next to Stats.fsti
+extern uint64_t Stats_clock(void);
+
+// Flags of Metrics_handshake_ended, as passed by mitlsffi.c
+#define METRICS_HRR                   1
+#define METRICS_RESUMPTION_OFFERED    2
+#define METRICS_RESUMED               4
+#define METRICS_EARLY_DATA_OFFERED    8
+#define METRICS_EARLY_DATA_ACCEPTED  16
+
+typedef struct {
+  volatile uint32_t keys[MITLS_METRICS_SLOTS];
+  volatile uint64_t completed[MITLS_METRICS_SLOTS];
+  volatile uint64_t failed[MITLS_METRICS_SLOTS];
+} table;
+
+typedef struct {
+  volatile uint64_t count;
+  volatile uint64_t sum_us;
+  volatile uint64_t buckets[MITLS_LATENCY_BUCKETS];
+} histogram;
+
+static volatile uint64_t started, completed, failed;
+static volatile uint64_t resumption_hits, resumption_misses, hrr;
+static volatile uint64_t early_data_accepted, early_data_rejected;
+static table versions, cipher_suites, groups;
+static histogram handshake_latency, certificate_latency;
+
+static void count_code(table *t, uint16_t code, int ok)
+{
+  uint32_t key = (uint32_t)code + 1;
+  int i;
+  for (i = 0; i < MITLS_METRICS_SLOTS - 1; i++) {
+    uint32_t k = KEY_LOAD(&t->keys[i]);
+    if (k == key) break;
+    if (k == 0) {
+      if (KEY_CLAIM(&t->keys[i], key)) break;
+      // Taken by another code point meanwhile: check it again
+      if (KEY_LOAD(&t->keys[i]) == key) break;
+    }
+  }
+  if (ok) ADD(&t->completed[i], 1);
+  else ADD(&t->failed[i], 1);
+}
+
+static void record_latency(histogram *h, uint64_t t0)
+{
+  if (t0 == 0) return;
+  uint64_t us = (Stats_clock() - t0) / 1000;
+  int b = 0;
+  while (b < MITLS_LATENCY_BUCKETS - 1 && us >= ((uint64_t)1 << b)) b++;
+  ADD(&h->count, 1);
+  ADD(&h->sum_us, us);
+  ADD(&h->buckets[b], 1);
+}
+
+// A timestamp for Metrics_handshake_ended, or 0 in kernel mode
+uint64_t Metrics_handshake_started(void)
+{
+  ADD(&started, 1);
+  return Stats_clock();
+}
+
+void Metrics_handshake_ended(int ok, uint64_t t0, uint16_t version, uint16_t cipher_suite, uint16_t group, unsigned flags)
+{
+  ADD(ok ? &completed : &failed, 1);
+  count_code(&versions, version, ok);
+  count_code(&cipher_suites, cipher_suite, ok);
+  count_code(&groups, group, ok);
+  if (flags & METRICS_HRR) ADD(&hrr, 1);
+  if (flags & METRICS_RESUMPTION_OFFERED) {
+    ADD((flags & METRICS_RESUMED) ? &resumption_hits : &resumption_misses, 1);
+  }
+  if (flags & METRICS_EARLY_DATA_OFFERED) {
+    ADD((flags & METRICS_EARLY_DATA_ACCEPTED) ? &early_data_accepted : &early_data_rejected, 1);
+  }
+  record_latency(&handshake_latency, t0);
+}
+
+// Called with the Stats_clock() read before a certificate callback
+void Metrics_certificate(uint64_t t0)
+{
+  record_latency(&certificate_latency, t0);
+}
+
+static void get_table(const table *t, mitls_metrics_slot slots[MITLS_METRICS_SLOTS])
+{
+  memset(slots, 0, MITLS_METRICS_SLOTS * sizeof(mitls_metrics_slot));
+  for (int i = 0; i < MITLS_METRICS_SLOTS; i++) {
+    uint32_t k = KEY_LOAD(&t->keys[i]);
+    slots[i].code = (i == MITLS_METRICS_SLOTS - 1) ? MITLS_METRICS_OTHER : (k ? (uint16_t)(k - 1) : 0);
+    slots[i].completed = LOAD(&t->completed[i]);
+    slots[i].failed = LOAD(&t->failed[i]);
+  }
+}
+
+static void get_histogram(const histogram *h, mitls_latency_histogram *out)
+{
+  out->count = LOAD(&h->count);
+  out->sum_us = LOAD(&h->sum_us);
+  for (int b = 0; b < MITLS_LATENCY_BUCKETS; b++) {
+    out->buckets[b] = LOAD(&h->buckets[b]);
+  }
+}
+
+// Fills all the fields of m but size and the heap statistics
+void Metrics_get(mitls_global_metrics *m)
+{
+  m->version = MITLS_METRICS_VERSION;
+  m->handshakes_started = LOAD(&started);
+  m->handshakes_completed = LOAD(&completed);
+  m->handshakes_failed = LOAD(&failed);
+  m->resumption_hits = LOAD(&resumption_hits);
+  m->resumption_misses = LOAD(&resumption_misses);
+  m->hello_retry_requests = LOAD(&hrr);
+  m->early_data_accepted = LOAD(&early_data_accepted);
+  m->early_data_rejected = LOAD(&early_data_rejected);
+  get_table(&versions, m->versions);
+  get_table(&cipher_suites, m->cipher_suites);
+  get_table(&groups, m->groups);
+  get_histogram(&handshake_latency, &m->handshake_latency);
+  get_histogram(&certificate_latency, &m->certificate_latency);
+}
+
+// Appends to the text of Metrics_format, counting what does not fit
+typedef struct {
+  char *buffer;
+  size_t len;
+  size_t pos;
+} text;
+
+static void append(text *t, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  size_t room = (t->pos < t->len) ? t->len - t->pos : 0;
+  int n = vsnprintf(room ? t->buffer + t->pos : NULL, room, fmt, args);
+  va_end(args);
+  if (n > 0) t->pos += (size_t)n;
+}
+
+static void format_counter(text *t, const char *name, const char *help, uint64_t v)
+{
+  append(t, "# HELP mitls_%s %s\n# TYPE mitls_%s counter\nmitls_%s %llu\n",
+    name, help, name, name, (unsigned long long)v);
+}
+
+static void format_table(text *t, const char *label, const mitls_metrics_slot slots[MITLS_METRICS_SLOTS])
+{
+  append(t, "# HELP mitls_handshakes_by_%s_total Handshakes ended, by negotiated %s\n"
+    "# TYPE mitls_handshakes_by_%s_total counter\n", label, label, label);
+  for (int i = 0; i < MITLS_METRICS_SLOTS; i++) {
+    const mitls_metrics_slot *s = &slots[i];
+    char code[8];
+    if (s->completed == 0 && s->failed == 0) continue;
+    if (s->code == MITLS_METRICS_OTHER) snprintf(code, sizeof(code), "other");
+    else snprintf(code, sizeof(code), "0x%04x", s->code);
+    append(t, "mitls_handshakes_by_%s_total{%s=\"%s\",result=\"completed\"} %llu\n"
+      "mitls_handshakes_by_%s_total{%s=\"%s\",result=\"failed\"} %llu\n",
+      label, label, code, (unsigned long long)s->completed,
+      label, label, code, (unsigned long long)s->failed);
+  }
+}
+
+static void format_histogram(text *t, const char *name, const char *help, const mitls_latency_histogram *h)
+{
+  uint64_t n = 0;
+  append(t, "# HELP mitls_%s %s\n# TYPE mitls_%s histogram\n", name, help, name);
+  for (int b = 0; b < MITLS_LATENCY_BUCKETS - 1; b++) {
+    n += h->buckets[b];
+    uint64_t le = (uint64_t)1 << b;
+    append(t, "mitls_%s_bucket{le=\"%llu.%06llu\"} %llu\n", name,
+      (unsigned long long)(le / 1000000), (unsigned long long)(le % 1000000), (unsigned long long)n);
+  }
+  append(t, "mitls_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  append(t, "mitls_%s_sum %llu.%06llu\nmitls_%s_count %llu\n", name,
+    (unsigned long long)(h->sum_us / 1000000), (unsigned long long)(h->sum_us % 1000000),
+    name, (unsigned long long)h->count);
+}
+
+// Formats m, as returned by FFI_mitls_get_global_metrics
+size_t Metrics_format(const mitls_global_metrics *m, char *buffer, size_t buffer_len)
+{
+  text t = {.buffer = buffer, .len = buffer_len, .pos = 0};
+  if (buffer_len) buffer[0] = 0;
+
+  format_counter(&t, "handshakes_started_total", "Handshakes started", m->handshakes_started);
+  format_counter(&t, "handshakes_completed_total", "Handshakes completed", m->handshakes_completed);
+  format_counter(&t, "handshakes_failed_total", "Handshakes failed", m->handshakes_failed);
+  format_counter(&t, "resumption_hits_total", "Resumptions offered and accepted", m->resumption_hits);
+  format_counter(&t, "resumption_misses_total", "Resumptions offered and not accepted", m->resumption_misses);
+  format_counter(&t, "hello_retry_requests_total", "Handshakes with a HelloRetryRequest", m->hello_retry_requests);
+  format_counter(&t, "early_data_accepted_total", "0-RTT data offered and accepted", m->early_data_accepted);
+  format_counter(&t, "early_data_rejected_total", "0-RTT data offered and rejected", m->early_data_rejected);
+
+  format_table(&t, "version", m->versions);
+  format_table(&t, "cipher_suite", m->cipher_suites);
+  format_table(&t, "group", m->groups);
+
+  format_histogram(&t, "handshake_duration_seconds", "Handshake latency", &m->handshake_latency);
+  format_histogram(&t, "certificate_callback_duration_seconds", "Certificate callback latency", &m->certificate_latency);
+
+  append(&t, "# HELP mitls_global_heap_bytes Memory allocated in the global region\n"
+    "# TYPE mitls_global_heap_bytes gauge\nmitls_global_heap_bytes %llu\n",
+    (unsigned long long)m->global_heap_bytes);
+  append(&t, "# HELP mitls_global_heap_peak_bytes Peak memory allocated in the global region\n"
+    "# TYPE mitls_global_heap_peak_bytes gauge\nmitls_global_heap_peak_bytes %llu\n",
+    (unsigned long long)m->global_heap_peak_bytes);
+  return t.pos;
+}
@@ -149,21 +149,21 @@ PKI_select(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, Parsers_ProtocolVersion_protocol
   return dst;
 }
 
-static void* append(void* chain, size_t len, char **buf)
+// The certificates point into the read-only chain image kept by mipki,
+// which outlives the connections using the mipki state
+static void* append(void* chain, const char *cert, size_t len)
 {
   #if DEBUG
     printf("PKI| FORMAT::append adding %d bytes element\n", len);
   #endif
 
-  *buf = KRML_HOST_MALLOC(len);
-
   Prims_list__FStar_Bytes_bytes* cur = (Prims_list__FStar_Bytes_bytes*) chain;
   Prims_list__FStar_Bytes_bytes* new = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
 
   new->tag = Prims_Nil;
   cur->tag = Prims_Cons;
 
-  cur->hd = (FStar_Bytes_bytes){.length = len, .data = *buf};
+  cur->hd = (FStar_Bytes_bytes){.length = len, .data = cert};
   cur->tl = new;
   return (void*)new;
 }
@@ -178,7 +178,8 @@ Prims_list__FStar_Bytes_bytes* PKI_format(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, u
   #endif
 
   Prims_list__FStar_Bytes_bytes *res = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
-  mipki_format_alloc(pki, chain, (void*)res, append);
+  res->tag = Prims_Nil;
+  mipki_format_slices(pki, chain, (void*)res, append);
   return res;
 }
 
@@ -239,7 +240,8 @@ bool PKI_verify_(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
     cur = cur->tl;
   }
 
-  mipki_chain chain = mipki_parse_list(pki, ders, lens, chain_len);
+  int valid = 0;
+  mipki_chain chain = mipki_parse_list_validated(pki, ders, lens, chain_len, "", &valid);
   size_t slen = sig.length;
 
   if(chain == NULL)
@@ -251,7 +253,7 @@ bool PKI_verify_(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
   }
 
   // We don't validate hostname, but could with the callback state
-  if(!mipki_validate_chain(pki, chain, ""))
+  if(!valid)
   {
     #if DEBUG
       KRML_HOST_PRINTF("PKI| WARNING: chain validation failed, ignoring.\n");
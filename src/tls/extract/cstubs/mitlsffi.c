@@ -1,4 +1,5 @@
 #include <memory.h>
+#include <stddef.h>
 #include <stdarg.h>
 #if __APPLE__
 #include <sys/errno.h> // OS/X only provides include/sys/errno.h
@@ -46,31 +47,163 @@ typedef void (*p_log)(const char *fmt, ...);
 p_log g_LogPrint;
 #endif
 
-struct mitls_state {
-  HEAP_REGION rgn;
-  TLSConstants_config cfg;
-  Connection_connection cxn;
-};
-
-// BUGBUG: temporary global lock to protect global
-//         mutable variables in mitls.  Remove when
-//         the variables have their own protection.
+// Calls on the same connection are serialized by a per-connection lock,
+// calls on independent connections run in parallel. The few process-global
+// tables and keys used by miTLS have their own locks (see Locks.fsti).
 #if IS_WINDOWS
   #ifdef _KERNEL_MODE
-    FAST_MUTEX lock;
-    #define LOCK_MUTEX(x) ExAcquireFastMutex (x)
-    #define UNLOCK_MUTEX(x) ExReleaseFastMutex (x)
+    typedef EX_PUSH_LOCK mitls_lock;
+    #define INIT_LOCK(x) ExInitializePushLock(x)
+    #define DESTROY_LOCK(x)
+    #define LOCK_MUTEX(x) ExfAcquirePushLockExclusive(x)
+    #define UNLOCK_MUTEX(x) ExfReleasePushLockExclusive(x)
   #else
-    CRITICAL_SECTION lock;
-    #define LOCK_MUTEX(x) EnterCriticalSection(x)
-    #define UNLOCK_MUTEX(x) LeaveCriticalSection(x)
+    typedef SRWLOCK mitls_lock;
+    #define INIT_LOCK(x) InitializeSRWLock(x)
+    #define DESTROY_LOCK(x)
+    #define LOCK_MUTEX(x) AcquireSRWLockExclusive(x)
+    #define UNLOCK_MUTEX(x) ReleaseSRWLockExclusive(x)
   #endif
 #else
-static pthread_mutex_t lock;
+typedef pthread_mutex_t mitls_lock;
+#define INIT_LOCK(x) pthread_mutex_init(x, NULL)
+#define DESTROY_LOCK(x) pthread_mutex_destroy(x)
 #define LOCK_MUTEX(x) pthread_mutex_lock(x)
 #define UNLOCK_MUTEX(x) pthread_mutex_unlock(x)
 #endif
 
+#if IS_WINDOWS
+typedef volatile LONG mitls_refcount;
+#define REF_INCREMENT(x) InterlockedIncrement(x)
+#define REF_DECREMENT(x) InterlockedDecrement(x)
+#else
+typedef int mitls_refcount;
+#define REF_INCREMENT(x) __atomic_add_fetch(x, 1, __ATOMIC_ACQ_REL)
+#define REF_DECREMENT(x) __atomic_sub_fetch(x, 1, __ATOMIC_ACQ_REL)
+#endif
+
+#if IS_WINDOWS
+#define ATOMIC_STORE(x, v) InterlockedExchange(x, v)
+#define ATOMIC_LOAD(x) InterlockedCompareExchange(x, 0, 0)
+#define ATOMIC_CLAIM(x, old, v) (InterlockedCompareExchange(x, v, old) == (old))
+#define ATOMIC_STORE_PTR(x, v) InterlockedExchangePointer((PVOID volatile *)(x), v)
+#define ATOMIC_LOAD_PTR(x) InterlockedCompareExchangePointer((PVOID volatile *)(x), NULL, NULL)
+#else
+#define ATOMIC_STORE(x, v) __atomic_store_n(x, v, __ATOMIC_RELEASE)
+#define ATOMIC_LOAD(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+static inline int atomic_claim(mitls_refcount *x, int old, int v)
+{
+  return __atomic_compare_exchange_n(x, &old, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#define ATOMIC_CLAIM(x, old, v) atomic_claim(x, old, v)
+#define ATOMIC_STORE_PTR(x, v) __atomic_store_n(x, v, __ATOMIC_RELEASE)
+#define ATOMIC_LOAD_PTR(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+#endif
+
+// An immutable configuration, shared by the states created from it. The
+// config record and everything it points to live in rgn, which is only
+// destroyed once the last reference is released.
+struct mitls_config {
+  HEAP_REGION rgn;
+  mitls_refcount refs;
+  int is_server; // QUIC only
+  TLSConstants_config cfg;
+};
+
+// max_TLSPlaintext_fragment_length, the size of the records of FFI_ffiSend
+#define MAX_FRAGMENT 16384
+
+struct mitls_state {
+  HEAP_REGION rgn;
+  mitls_lock lock;
+  mitls_config *shared; // may be NULL
+  TLSConstants_config cfg;
+  Connection_connection cxn;
+  struct wrapped_transport_cb *tcb; // NULL in non-blocking mode
+  struct wrapped_cert_cb *cert_cb; // set by FFI_mitls_configure_cert_callbacks
+
+  // Non-blocking mode (FFI_mitls_process)
+  int is_process;
+  int is_complete;
+  int is_closed;
+  const unsigned char *in;   // caller's input, valid during FFI_mitls_process
+  size_t in_len;
+  size_t in_pos;
+  unsigned char *out;        // records queued for the caller's output
+  size_t out_cap;
+  size_t out_len;
+  size_t out_pos;
+  FStar_Bytes_bytes data;    // application data not yet returned
+  size_t data_pos;
+
+  unsigned char *gather;     // MAX_FRAGMENT bytes, for FFI_mitls_sendv
+
+  // Signature left pending by the sign callback (MITLS_CERT_PENDING). The
+  // token and cert_done are atomic, as FFI_mitls_cert_complete does not take
+  // the lock: it may be called from the callback itself.
+  unsigned char *cert_token; // the sig buffer passed to the callback
+  size_t cert_result;        // signature length, set by FFI_mitls_cert_complete
+  mitls_refcount cert_done;  // CERT_WAITING, CERT_COMPLETING or CERT_DONE
+
+  mitls_stats stats;         // counted under the lock
+  uint64_t hs_start;         // from Metrics_handshake_started, 0 in kernel mode
+  int hs_started;            // counted in the global metrics
+  int hs_ended;              // counted in the global metrics
+};
+
+// The connection processed by FFI_mitls_process on the current thread, if
+// any; sign callbacks of other calls, including FFI_mitls_quic_process,
+// cannot return MITLS_CERT_PENDING.
+// There is no thread-local storage in kernel mode.
+#ifdef _KERNEL_MODE
+#define SET_CURRENT_STATE(s)
+#define CURRENT_STATE NULL
+#else
+#if defined(_MSC_VER)
+static __declspec(thread) mitls_state *current_state = NULL;
+#else
+static __thread mitls_state *current_state = NULL;
+#endif
+#define SET_CURRENT_STATE(s) (current_state = (s))
+#define CURRENT_STATE current_state
+#endif
+
+// States of mitls_state.cert_done
+#define CERT_WAITING    0
+#define CERT_DONE       1
+#define CERT_COMPLETING 2 // cert_result is being written
+
+// Called under the lock when the handshake gives up a pending signature;
+// a late FFI_mitls_cert_complete then finds no token and fails
+static void cert_cancel(mitls_state *state)
+{
+  ATOMIC_STORE_PTR(&state->cert_token, NULL);
+  ATOMIC_STORE(&state->cert_done, CERT_WAITING);
+}
+
+// Implemented in stats.c, next to Stats.fsti
+extern mitls_stats *Stats_enter(mitls_stats *stats);
+extern uint64_t Stats_clock(void);
+extern void Stats_stop(uint8_t phase, uint64_t t0);
+#define STATS_CERTIFICATE 3
+
+// Implemented in metrics.c
+extern uint64_t Metrics_handshake_started(void);
+extern void Metrics_handshake_ended(int ok, uint64_t t0, uint16_t version, uint16_t cipher_suite, uint16_t group, unsigned flags);
+extern void Metrics_certificate(uint64_t t0);
+extern void Metrics_get(mitls_global_metrics *m);
+extern size_t Metrics_format(const mitls_global_metrics *m, char *buffer, size_t buffer_len);
+#define METRICS_HRR                   1
+#define METRICS_RESUMPTION_OFFERED    2
+#define METRICS_RESUMED               4
+#define METRICS_EARLY_DATA_OFFERED    8
+#define METRICS_EARLY_DATA_ACCEPTED  16
+
+// Count the F* code of a call into the stats of its connection. Entered
+// before the heap region, so that the counters are also left on out of memory
+#define ENTER_STATS(s) mitls_stats *OldStats = Stats_enter(&(s)->stats)
+#define LEAVE_STATS() Stats_enter(OldStats)
+
 static Prims_string CopyPrimsString(const char *src)
 {
     size_t len = strlen(src)+1;
@@ -115,12 +248,27 @@ void TracePrintf(const char *fmt, ...)
 //
 // Hosts may provide a callback function for debug tracing.
 //
+// Implemented in trace.c, next to Trace.fsti
+extern void Trace_set_level(int module, int level);
+extern int Trace_set_ring(size_t records);
+
 void MITLS_CALLCONV FFI_mitls_set_trace_callback(pfn_mitls_trace_callback cb)
 {
     trace_callback = cb;
 #if LOG_TO_CHOICE
     g_LogPrint = TracePrintf;
 #endif
+    Trace_set_level(TLS_trace_all, TLS_trace_verbose);
+}
+
+void MITLS_CALLCONV FFI_mitls_set_trace_level(mitls_trace_module module, mitls_trace_level level)
+{
+    Trace_set_level(module, level);
+}
+
+int MITLS_CALLCONV FFI_mitls_set_trace_ring(size_t records)
+{
+    return Trace_set_ring(records);
 }
 
 //
@@ -143,37 +291,43 @@ int MITLS_CALLCONV FFI_mitls_init(void)
 
   #if IS_WINDOWS
     #ifdef _KERNEL_MODE
-    ExInitializeFastMutex(&lock);
       #if LOG_TO_CHOICE
       if (!g_LogPrint) {
         g_LogPrint = (p_log)DbgPrint;
       }
       #endif
     #else /* _KERNEL_MODE */
-    InitializeCriticalSection(&lock);
       #if LOG_TO_CHOICE
       if (!g_LogPrint) {
         if (GetEnvironmentVariableA("MITLS_LOG", NULL, 0) == 0) {
           g_LogPrint = (p_log)NoPrintf; // no logging
+          Trace_set_level(TLS_trace_all, TLS_trace_off);
         } else {
           g_LogPrint = (p_log)printf;
         }
       }
+      #else
+      // Traces always go to printf: keep them off unless asked for
+      if (!trace_callback && GetEnvironmentVariableA("MITLS_LOG", NULL, 0) == 0) {
+        Trace_set_level(TLS_trace_all, TLS_trace_off);
+      }
       #endif
     #endif /* _KERNEL_MODE */
   #else /* IS_WINDOWS */
-  if (pthread_mutex_init(&lock, NULL) != 0) {
-    HeapRegionCleanup();
-    return 0;
-  }
   #if LOG_TO_CHOICE
     if (!g_LogPrint) {
       if (getenv("MITLS_LOG") == NULL) {
         g_LogPrint = NoPrintf; // default to no logging
+        Trace_set_level(TLS_trace_all, TLS_trace_off);
       } else {
         g_LogPrint = (p_log)printf;
       }
     }
+  #else
+    // Traces always go to printf: keep them off unless asked for
+    if (!trace_callback && getenv("MITLS_LOG") == NULL) {
+      Trace_set_level(TLS_trace_all, TLS_trace_off);
+    }
   #endif
 #endif
 
@@ -189,21 +343,57 @@ int MITLS_CALLCONV FFI_mitls_init(void)
   return 1; // success
 }
 
+// Implemented in key_pool.c, next to KeyPool.fsti
+extern void KeyPool_configure(unsigned threads, const mitls_key_pool_group *groups, size_t count);
+extern void KeyPool_release(HEAP_REGION owner);
+
 void MITLS_CALLCONV FFI_mitls_cleanup(void)
 {
+  KeyPool_configure(0, NULL, 0); // the workers use the RNG
+  Trace_set_ring(0);
   Random_cleanup();
-    
-#if IS_WINDOWS
-  #ifndef _KERNEL_MODE
-  DeleteCriticalSection(&lock);
-  #endif
-#else
-  pthread_mutex_destroy(&lock);
-#endif
-
   HeapRegionCleanup();
 }
 
+// Called by the host app to set how many closed connections' heap regions
+// each thread keeps for reuse by its next connections (0 disables reuse)
+void MITLS_CALLCONV FFI_mitls_set_region_pool_size(unsigned int max_regions)
+{
+    HeapRegionSetPoolSize(max_regions);
+}
+
+// Called by the host app to free the regions kept by the calling thread,
+// e.g. when a worker becomes idle. Threads release their pool on exit.
+void MITLS_CALLCONV FFI_mitls_release_region_pool(void)
+{
+    HeapRegionReleasePool();
+}
+
+// Implemented in session_cache.c, next to SessionCache.fsti
+extern void SessionCache_configure(size_t max_bytes, uint32_t lifetime);
+extern void SessionCache_get_stats(mitls_session_cache_stats *stats);
+extern void SessionCache_set_store(void *cb_state, const mitls_session_store *store);
+
+void MITLS_CALLCONV FFI_mitls_configure_session_cache(size_t max_bytes, uint32_t lifetime)
+{
+    SessionCache_configure(max_bytes, lifetime);
+}
+
+void MITLS_CALLCONV FFI_mitls_get_session_cache_stats(mitls_session_cache_stats *stats)
+{
+    SessionCache_get_stats(stats);
+}
+
+void MITLS_CALLCONV FFI_mitls_configure_session_store(void *cb_state, const mitls_session_store *store)
+{
+    SessionCache_set_store(cb_state, store);
+}
+
+void MITLS_CALLCONV FFI_mitls_configure_key_pool(unsigned int threads, const mitls_key_pool_group *groups, size_t groups_count)
+{
+    KeyPool_configure(threads, groups, groups_count);
+}
+
 // Called by the host app to configure miTLS ahead of creating a connection
 int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_version, const char *host_name)
 {
@@ -223,7 +413,7 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
     TLSConstants_config config = FFI_ffiConfig(version, (FStar_Bytes_bytes){.data=host,.length=strlen(host_name)});
 
     // Allocate space on the heap, to store an OCaml value
-    mitls_state *s = (mitls_state*)KRML_HOST_MALLOC(sizeof(mitls_state));
+    mitls_state *s = (mitls_state*)KRML_HOST_CALLOC(1, sizeof(mitls_state));
     s->cfg = config;
     s->rgn = rgn;
     *state = s;
@@ -232,21 +422,90 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY) {
         DESTROY_HEAP_REGION(rgn);
-        ret = 0;
+        *state = NULL;
+        return 0;
     }
+    INIT_LOCK(&(*state)->lock);
     return ret;
 }
 
+// Called by the host app to turn a configured (but not connected) state
+// into an immutable config, to be shared by many connections. The state
+// is consumed: its region now holds the config.
+int MITLS_CALLCONV FFI_mitls_config_freeze(/* in */ mitls_state *state, /* out */ mitls_config **config)
+{
+    *config = NULL;
+    if (state->tcb != NULL || state->is_process || state->shared != NULL) {
+        return 0; // already connected, or not the owner of its config
+    }
+
+    HEAP_REGION rgn = state->rgn;
+    mitls_config *c = NULL;
+    ENTER_HEAP_REGION(rgn);
+    c = (mitls_config*)KRML_HOST_CALLOC(1, sizeof(mitls_config));
+    c->rgn = rgn;
+    c->refs = 1;
+    c->cfg = state->cfg;
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY || c == NULL) {
+        return 0;
+    }
+    DESTROY_LOCK(&state->lock);
+    ENTER_HEAP_REGION(rgn);
+    KRML_HOST_FREE(state);
+    LEAVE_HEAP_REGION();
+    *config = c;
+    return 1;
+}
+
+// Called by the host app to create a connection state from a shared config.
+// Only the per-connection state is allocated; the configure_* functions may
+// still be used to override settings for this connection alone.
+int MITLS_CALLCONV FFI_mitls_configure_shared(/* out */ mitls_state **state, /* in */ mitls_config *config)
+{
+    *state = NULL;
+
+    HEAP_REGION rgn;
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+    mitls_state *s = (mitls_state*)KRML_HOST_CALLOC(1, sizeof(mitls_state));
+    if (s) {
+        s->rgn = rgn;
+        s->cfg = config->cfg;
+        s->shared = config;
+        *state = s;
+    }
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY || *state == NULL) {
+        DESTROY_HEAP_REGION(rgn);
+        *state = NULL;
+        return 0;
+    }
+    REF_INCREMENT(&config->refs);
+    INIT_LOCK(&(*state)->lock);
+    return 1;
+}
+
+// Called by the host app to drop its reference to a shared config; the
+// config is freed once all states created from it are closed too.
+void MITLS_CALLCONV FFI_mitls_config_release(/* in */ mitls_config *config)
+{
+    if (config && REF_DECREMENT(&config->refs) == 0) {
+        HEAP_REGION rgn = config->rgn;
+        DESTROY_HEAP_REGION(rgn);
+    }
+}
+
 int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int b = 0;
-    LOCK_MUTEX(&lock);
     ENTER_GLOBAL_HEAP_REGION();
     FStar_Bytes_bytes key;
     MakeFStar_Bytes_bytes(&key, tk, klen);
     b = FFI_ffiSetTicketKey(alg, key);
     LEAVE_GLOBAL_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -256,13 +515,11 @@ int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char
 int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int b = 0;
-    LOCK_MUTEX(&lock);
     ENTER_GLOBAL_HEAP_REGION();
     FStar_Bytes_bytes key;
     MakeFStar_Bytes_bytes(&key, tk, klen);
     b = FFI_ffiSetSealingKey(alg, key);
     LEAVE_GLOBAL_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -284,6 +541,19 @@ int MITLS_CALLCONV FFI_mitls_configure_ticket(mitls_state *state, const mitls_ti
     return (b) ? 1 : 0;
 }
 
+int MITLS_CALLCONV FFI_mitls_configure_cached_resumption(mitls_state *state, const unsigned char *scope, size_t scope_len)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    FStar_Bytes_bytes sc;
+    MakeFStar_Bytes_bytes(&sc, scope, scope_len);
+    state->cfg = FFI_ffiSetCachedResumption(state->cfg, sc);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return 1;
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_cipher_suites(/* in */ mitls_state *state, const char * cs)
 {
     ENTER_HEAP_REGION(state->rgn);
@@ -491,10 +761,11 @@ int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *c
   return 1;
 }
 
-typedef struct {
+typedef struct wrapped_cert_cb {
   void* cb_state;
   pfn_FFI_cert_select_cb select;
   pfn_FFI_cert_format_cb format;
+  pfn_FFI_cert_get_chain_cb get_chain; // may be NULL, used instead of format
   pfn_FFI_cert_sign_cb sign;
   pfn_FFI_cert_verify_cb verify;
 } wrapped_cert_cb;
@@ -593,10 +864,13 @@ static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_sign
   }
 
   FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_signatureScheme res;
+  uint64_t t0 = Stats_clock();
   void* chain = s->select(s->cb_state, convert_pv(pv),
     (const unsigned char*)sni.data, sni.length,
     (const unsigned char*)alpn.data, alpn.length,
     sigalgs, sigalgs_len, &selected);
+  Stats_stop(STATS_CERTIFICATE, t0);
+  Metrics_certificate(t0);
 
   if(chain == NULL) {
     res.tag = FStar_Pervasives_Native_None;
@@ -612,11 +886,48 @@ static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_sign
   return res;
 }
 
+// The certificates of a chain returned by get_chain, pointing into it as
+// PKI_format does; a truncated chain yields an empty list
+static Prims_list__FStar_Bytes_bytes* chain_slices(const unsigned char *cur, size_t len)
+{
+  const unsigned char *end = cur + len;
+  Prims_list__FStar_Bytes_bytes *res = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
+  Prims_list__FStar_Bytes_bytes *last = res;
+
+  last->tag = Prims_Nil;
+  while (cur != NULL && end - cur > 3) {
+    size_t cert_len = ((size_t)cur[0] << 16) + (cur[1] << 8) + cur[2];
+    if (cert_len > (size_t)(end - cur) - 3) {
+      res->tag = Prims_Nil;
+      break;
+    }
+    last->tag = Prims_Cons;
+    last->hd = (FStar_Bytes_bytes){.length = cert_len, .data = (const char*)cur + 3};
+    last->tl = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
+    last = last->tl;
+    last->tag = Prims_Nil;
+    cur += 3 + cert_len;
+  }
+  return res;
+}
+
 static Prims_list__FStar_Bytes_bytes* wrapped_format(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, uint64_t cert)
 {
   wrapped_cert_cb* s = (wrapped_cert_cb*)cbs;
+  if (s->get_chain != NULL) {
+    const unsigned char *chain = NULL;
+    uint64_t t0 = Stats_clock();
+    size_t len = s->get_chain(s->cb_state, (const void *)(size_t)cert, &chain);
+    Stats_stop(STATS_CERTIFICATE, t0);
+    Metrics_certificate(t0);
+    return chain_slices(chain, len);
+  }
+
   unsigned char *buffer = KRML_HOST_MALLOC(MAX_CHAIN_LEN);
+  uint64_t t0 = Stats_clock();
   size_t r = s->format(s->cb_state, (const void *)(size_t)cert, buffer);
+  Stats_stop(STATS_CERTIFICATE, t0);
+  Metrics_certificate(t0);
   FStar_Bytes_bytes b = {.length = r, .data = (const char*)buffer};
   return FFI_ffiSplitChain(b);
 }
@@ -627,14 +938,48 @@ static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_sign(
   Parsers_SignatureScheme_signatureScheme sa, FStar_Bytes_bytes tbs)
 {
   wrapped_cert_cb* s = (wrapped_cert_cb*)cbs;
-  unsigned char* sig = KRML_HOST_MALLOC(MAX_SIGNATURE_LEN);
+  mitls_state *state = CURRENT_STATE;
   FStar_Pervasives_Native_option__FStar_Bytes_bytes res = {.tag = FStar_Pervasives_Native_None};
-  mitls_signature_scheme sigalg = pki_of_tls(sa.tag);
+  FStar_Bytes_bytes pending = {.length = 0, .data = NULL};
+  unsigned char* sig;
+  size_t slen;
+
+  if (state != NULL && ATOMIC_LOAD_PTR(&state->cert_token) != NULL) {
+    // Called again by the suspended handshake (see Old.Handshake.server_CertificateVerify_13)
+    if (ATOMIC_LOAD(&state->cert_done) != CERT_DONE) {
+      res.tag = FStar_Pervasives_Native_Some;
+      res.v = pending;
+      return res;
+    }
+    sig = ATOMIC_LOAD_PTR(&state->cert_token);
+    slen = state->cert_result;
+    cert_cancel(state);
+  } else {
+    mitls_signature_scheme sigalg = pki_of_tls(sa.tag);
+    sig = KRML_HOST_MALLOC(MAX_SIGNATURE_LEN);
 
-  size_t slen = s->sign(s->cb_state, (const void *)(size_t)cert, sigalg,
-    (const unsigned char*)tbs.data, tbs.length, sig);
+    // Set before the call, as the application may complete from another thread
+    if (state != NULL) {
+      ATOMIC_STORE(&state->cert_done, CERT_WAITING);
+      ATOMIC_STORE_PTR(&state->cert_token, sig);
+    }
+    uint64_t t0 = Stats_clock();
+    slen = s->sign(s->cb_state, (const void *)(size_t)cert, sigalg,
+      (const unsigned char*)tbs.data, tbs.length, sig);
+    Stats_stop(STATS_CERTIFICATE, t0);
+    Metrics_certificate(t0);
+
+    if (slen == MITLS_CERT_PENDING && state != NULL) {
+      res.tag = FStar_Pervasives_Native_Some;
+      res.v = pending;
+      return res;
+    }
+    if (state != NULL) {
+      cert_cancel(state);
+    }
+  }
 
-  if(slen > 0) {
+  if(slen > 0 && slen <= MAX_SIGNATURE_LEN) {
     res.tag = FStar_Pervasives_Native_Some;
     res.v = (FStar_Bytes_bytes){.length = slen, .data = (const char*)sig};
   }
@@ -642,6 +987,8 @@ static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_sign(
   return res;
 }
 
+// Always synchronous: a pending verification would have to park the client
+// in the middle of the server's encrypted flight
 static bool wrapped_verify(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
   Prims_list__FStar_Bytes_bytes *certs, Parsers_SignatureScheme_signatureScheme sa,
   FStar_Bytes_bytes tbs, FStar_Bytes_bytes sig)
@@ -650,10 +997,13 @@ static bool wrapped_verify(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
   FStar_Bytes_bytes chain = Cert_certificateListBytes(certs);
   mitls_signature_scheme sigalg = pki_of_tls(sa.tag);
 
+  uint64_t t0 = Stats_clock();
   int r = (s->verify(s->cb_state,
     (const unsigned char*)chain.data, chain.length, sigalg,
     (const unsigned char*)tbs.data, tbs.length,
     (const unsigned char*)sig.data, sig.length) != 0);
+  Stats_stop(STATS_CERTIFICATE, t0);
+  Metrics_certificate(t0);
 
   return r;
 }
@@ -666,6 +1016,7 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   cbs->cb_state = cb_state;
   cbs->select = cert_cb->select;
   cbs->format = cert_cb->format;
+  cbs->get_chain = NULL;
   cbs->sign = cert_cb->sign;
   cbs->verify = cert_cb->verify;
 
@@ -682,6 +1033,7 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   };
 
   state->cfg = FFI_ffiSetCertCallbacks(state->cfg, cb);
+  state->cert_cb = cbs;
   LEAVE_HEAP_REGION();
   if (HAD_OUT_OF_MEMORY) {
     return 0;
@@ -689,6 +1041,15 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   return 1;
 }
 
+int MITLS_CALLCONV FFI_mitls_configure_cert_get_chain(/* in */ mitls_state *state, pfn_FFI_cert_get_chain_cb get_chain)
+{
+  if (state->cert_cb == NULL) {
+    return 0;
+  }
+  state->cert_cb->get_chain = get_chain;
+  return 1;
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, uint32_t max_early_data)
 {
     ENTER_HEAP_REGION(state->rgn);
@@ -700,13 +1061,65 @@ int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, u
     return 1;
 }
 
+// Count the end of a handshake in the global metrics, with what it
+// negotiated, or nothing if it ran out of memory (s == NULL)
+static void count_handshake(int ok, uint64_t t0, const Old_Handshake_summary *s)
+{
+  unsigned flags = 0;
+  if (s == NULL) {
+    Metrics_handshake_ended(0, t0, 0, 0, 0, 0);
+    return;
+  }
+  if (s->sum_hrr) flags |= METRICS_HRR;
+  if (s->sum_resumption_offered) flags |= METRICS_RESUMPTION_OFFERED;
+  if (s->sum_resumed) flags |= METRICS_RESUMED;
+  if (s->sum_early_data_offered) flags |= METRICS_EARLY_DATA_OFFERED;
+  if (s->sum_early_data_accepted) flags |= METRICS_EARLY_DATA_ACCEPTED;
+  Metrics_handshake_ended(ok, t0, s->sum_version, s->sum_cipher_suite, s->sum_group, flags);
+}
+
+// Called once the handshake of state->cxn completed or failed, under
+// the lock and in the heap region of state
+static void handshake_ended(mitls_state *state, int ok)
+{
+  if (!state->hs_ended) {
+    Old_Handshake_summary s = FFI_ffiGetSummary(state->cxn);
+    state->hs_ended = 1;
+    count_handshake(ok, state->hs_start, &s);
+  }
+}
+
+// Called under the lock, after a call on state ran out of memory
+static void handshake_out_of_memory(mitls_state *state)
+{
+  if (!state->hs_ended) {
+    state->hs_ended = 1;
+    count_handshake(0, state->hs_start, NULL);
+  }
+}
+
+// Called on close: a handshake started but never ended (e.g. the peer
+// reset a process-mode connection) is counted as failed
+static void handshake_abandoned(mitls_state *state)
+{
+  if (state->hs_started && !state->hs_ended) {
+    state->hs_ended = 1;
+    count_handshake(0, state->hs_start, NULL);
+  }
+}
+
 // Called by the host app to free a mitls_state allocated by FFI_mitls_configure()
 void MITLS_CALLCONV FFI_mitls_close(mitls_state *state)
 {
     if (state) {
         HEAP_REGION rgn = state->rgn;
+        mitls_config *shared = state->shared;
+        handshake_abandoned(state);
+        DESTROY_LOCK(&state->lock);
         KRML_HOST_FREE(state);
+        KeyPool_release(rgn); // the pooled key shares the connection took
         DESTROY_HEAP_REGION(rgn);
+        FFI_mitls_config_release(shared);
     }
 }
 
@@ -717,21 +1130,67 @@ void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv)
     LEAVE_HEAP_REGION();
 }
 
-typedef struct {
+typedef struct wrapped_transport_cb {
   void* send_recv_ctx;
   pfn_FFI_send send;
   pfn_FFI_recv recv;
+  mitls_stats *stats; // counted directly, also in kernel mode
+
+  // While corked, records are collected here and sent at once by uncork
+  int corked;
+  unsigned char *cork;
+  size_t cork_cap;
+  size_t cork_len;
 } wrapped_transport_cb;
 
 static int32_t wrapped_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
 {
   wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
+  if (tcb->corked) {
+    if (tcb->cork_len + buffer_size > tcb->cork_cap) {
+      size_t cap = tcb->cork_cap ? tcb->cork_cap : 16384;
+      while (cap < tcb->cork_len + buffer_size) cap *= 2;
+      unsigned char *cork = KRML_HOST_MALLOC(cap);
+      if (cork == NULL) {
+        return -1;
+      }
+      if (tcb->cork_len) {
+        memcpy(cork, tcb->cork, tcb->cork_len);
+      }
+      KRML_HOST_FREE(tcb->cork);
+      tcb->cork = cork;
+      tcb->cork_cap = cap;
+    }
+    memcpy(tcb->cork + tcb->cork_len, buffer, buffer_size);
+    tcb->cork_len += buffer_size;
+    return (int32_t)buffer_size;
+  }
+  tcb->stats->transport_sends++;
   return (int32_t)tcb->send(tcb->send_recv_ctx, (const void*)buffer, (size_t)buffer_size);
 }
 
+// Send the records collected since the transport was corked
+static int wrapped_uncork(wrapped_transport_cb* tcb)
+{
+  size_t sent = 0;
+  tcb->corked = 0;
+  while (sent < tcb->cork_len) {
+    tcb->stats->transport_sends++;
+    int r = tcb->send(tcb->send_recv_ctx, tcb->cork + sent, tcb->cork_len - sent);
+    if (r <= 0) {
+      break;
+    }
+    sent += r;
+  }
+  int ret = (sent == tcb->cork_len);
+  tcb->cork_len = 0;
+  return ret;
+}
+
 static int32_t wrapped_recv(void* ctx, uint8_t* buffer, uint32_t len)
 {
   wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
+  tcb->stats->transport_receives++;
   return (int32_t)tcb->recv(tcb->send_recv_ctx, (void*)buffer, (size_t)len);
 }
 
@@ -739,20 +1198,30 @@ static int32_t wrapped_recv(void* ctx, uint8_t* buffer, uint32_t len)
 int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
 {
     int ret = 0;
-    LOCK_MUTEX(&lock);
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
     ENTER_HEAP_REGION(state->rgn);
 
-    wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
+    wrapped_transport_cb* tcb = KRML_HOST_CALLOC(1, sizeof(wrapped_transport_cb));
     tcb->send_recv_ctx = send_recv_ctx;
     tcb->send = psend;
     tcb->recv = precv;
+    tcb->stats = &state->stats;
+    state->tcb = tcb;
 
+    state->hs_start = Metrics_handshake_started();
+    state->hs_started = 1;
     K___Connection_connection_Prims_int result = FFI_connect((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
     state->cxn = result.fst;
     ret = (result.snd == 0);
+    handshake_ended(state, ret);
 
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
+    LEAVE_STATS();
+    if (HAD_OUT_OF_MEMORY) {
+        handshake_out_of_memory(state);
+    }
+    UNLOCK_MUTEX(&state->lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -763,20 +1232,30 @@ int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pf
 int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
 {
     int ret = 0;
-    LOCK_MUTEX(&lock);
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
     ENTER_HEAP_REGION(state->rgn);
 
-    wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
+    wrapped_transport_cb* tcb = KRML_HOST_CALLOC(1, sizeof(wrapped_transport_cb));
     tcb->send_recv_ctx = send_recv_ctx;
     tcb->send = psend;
     tcb->recv = precv;
+    tcb->stats = &state->stats;
+    state->tcb = tcb;
 
+    state->hs_start = Metrics_handshake_started();
+    state->hs_started = 1;
     K___Connection_connection_Prims_int result = FFI_ffiAcceptConnected((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
     state->cxn = result.fst;
     ret = (result.snd == 0) ? 1 : 0; // return success (1) if result.snd is 0.
+    handshake_ended(state, ret);
 
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
+    LEAVE_STATS();
+    if (HAD_OUT_OF_MEMORY) {
+        handshake_out_of_memory(state);
+    }
+    UNLOCK_MUTEX(&state->lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -788,11 +1267,13 @@ int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned ch
 {
     int ret;
 
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
     ENTER_HEAP_REGION(state->rgn);
-    LOCK_MUTEX(&lock);
     ret = FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = (const char*)buffer, .length = buffer_size});
-    UNLOCK_MUTEX(&lock);
     LEAVE_HEAP_REGION();
+    LEAVE_STATS();
+    UNLOCK_MUTEX(&state->lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -800,6 +1281,69 @@ int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned ch
     return 1;
 }
 
+// Called by the host app to transmit several buffers as one message
+int MITLS_CALLCONV FFI_mitls_sendv(/* in */ mitls_state *state, const mitls_iovec *iov, size_t iov_count)
+{
+    int ret = 1;
+    size_t i, len = 0;
+
+    for (i = 0; i < iov_count; i++) {
+        len += iov[i].iov_len;
+    }
+
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
+    ENTER_HEAP_REGION(state->rgn);
+    if (state->tcb) {
+        state->tcb->corked = 1;
+    }
+    if (len == 0) {
+        ret = (FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = NULL, .length = 0}) == 0);
+    }
+    // Records are cut from the whole message, not from each buffer, so that
+    // all but the last one are full-size. Records within a buffer are sent
+    // from it; only those spanning buffers are gathered, in state->gather.
+    size_t pos = 0;  // offset in the message of the record being built
+    size_t fill = 0; // bytes of that record gathered so far
+    for (i = 0; ret && i < iov_count; i++) {
+        const char *p = (const char*)iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+        while (ret && n) {
+            size_t rec = (len - pos < MAX_FRAGMENT) ? len - pos : MAX_FRAGMENT;
+            size_t take;
+            if (fill == 0 && n >= rec) {
+                ret = (FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = p, .length = rec}) == 0);
+                take = rec;
+                pos += rec;
+            } else {
+                if (state->gather == NULL) {
+                    state->gather = KRML_HOST_MALLOC(MAX_FRAGMENT);
+                }
+                take = (rec - fill < n) ? rec - fill : n;
+                memcpy(state->gather + fill, p, take);
+                fill += take;
+                if (fill == rec) {
+                    ret = (FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = (const char*)state->gather, .length = rec}) == 0);
+                    pos += rec;
+                    fill = 0;
+                }
+            }
+            p += take;
+            n -= take;
+        }
+    }
+    if (state->tcb) {
+        ret = wrapped_uncork(state->tcb) && ret;
+    }
+    LEAVE_HEAP_REGION();
+    LEAVE_STATS();
+    UNLOCK_MUTEX(&state->lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret;
+}
+
 // Called by the host app to receive a packet
 unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size)
 {
@@ -807,7 +1351,8 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
     FStar_Bytes_bytes ret = {.data=NULL,.length=0};
     *packet_size = 0;
 
-    LOCK_MUTEX(&lock);
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
     ENTER_HEAP_REGION(state->rgn);
 
     ret = FFI_ffiRecv(state->cxn);
@@ -816,7 +1361,8 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
       memcpy((char*)p, ret.data, ret.length);
     }
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
+    LEAVE_STATS();
+    UNLOCK_MUTEX(&state->lock);
     if (HAD_OUT_OF_MEMORY) {
         return NULL;
     }
@@ -824,6 +1370,251 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
     return p;
 }
 
+// Called by the host app to receive a packet copied into its own buffer. The
+// plaintext returned by FFI_ffiRecv is copied from; any that does not fit is
+// kept by the connection and returned first on the next call.
+int MITLS_CALLCONV FFI_mitls_receive_copy(/* in */ mitls_state *state, /* out */ unsigned char *buffer, size_t buffer_size, /* out */ size_t *packet_size)
+{
+    int ret = 1;
+    *packet_size = 0;
+
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
+    ENTER_HEAP_REGION(state->rgn);
+    if (state->data_pos == state->data.length) {
+      state->data = FFI_ffiRecv(state->cxn);
+      state->data_pos = 0;
+      ret = (state->data.length != 0);
+    }
+    size_t n = state->data.length - state->data_pos;
+    if (n > buffer_size) n = buffer_size;
+    if (n) {
+      memcpy(buffer, state->data.data + state->data_pos, n);
+      state->data_pos += n;
+    }
+    *packet_size = n;
+    LEAVE_HEAP_REGION();
+    LEAVE_STATS();
+    UNLOCK_MUTEX(&state->lock);
+    if (HAD_OUT_OF_MEMORY) {
+        *packet_size = 0;
+        return 0;
+    }
+    return ret;
+}
+
+// Transport callbacks of non-blocking connections: recv reads from the
+// input of the current FFI_mitls_process call, and returns 0 once it is
+// exhausted (so TLS.read returns ReadWouldBlock); send queues the records
+// until the caller provides room for them.
+static int32_t process_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
+{
+  mitls_state *state = (mitls_state*) ctx;
+  if (state->out_len + buffer_size > state->out_cap) {
+    size_t pending = state->out_len - state->out_pos;
+    size_t cap = state->out_cap ? state->out_cap : 4096;
+    while (cap < pending + buffer_size) cap *= 2;
+    unsigned char *out = KRML_HOST_MALLOC(cap);
+    if (out == NULL) {
+      return -1;
+    }
+    if (pending) {
+      memcpy(out, state->out + state->out_pos, pending);
+    }
+    KRML_HOST_FREE(state->out);
+    state->out = out;
+    state->out_cap = cap;
+    state->out_len = pending;
+    state->out_pos = 0;
+  }
+  memcpy(state->out + state->out_len, buffer, buffer_size);
+  state->out_len += buffer_size;
+  return (int32_t)buffer_size;
+}
+
+static int32_t process_recv(void* ctx, uint8_t* buffer, uint32_t len)
+{
+  mitls_state *state = (mitls_state*) ctx;
+  size_t n = state->in_len - state->in_pos;
+  if (n > len) n = len;
+  if (n) {
+    memcpy(buffer, state->in + state->in_pos, n);
+    state->in_pos += n;
+  }
+  return (int32_t)n;
+}
+
+// Called by the host app to create a non-blocking TLS connection
+int MITLS_CALLCONV FFI_mitls_process_start(/* in */ mitls_state *state, int is_server)
+{
+    LOCK_MUTEX(&state->lock);
+    ENTER_STATS(state);
+    ENTER_HEAP_REGION(state->rgn);
+    state->hs_start = Metrics_handshake_started();
+    state->hs_started = 1;
+    state->cxn = FFI_ffiStart((FStar_Dyn_dyn)state, process_send, process_recv, state->cfg, is_server ? true : false);
+    state->is_process = 1;
+    LEAVE_HEAP_REGION();
+    LEAVE_STATS();
+    if (HAD_OUT_OF_MEMORY) {
+        handshake_out_of_memory(state);
+    }
+    UNLOCK_MUTEX(&state->lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return 1;
+}
+
+// Copy as much pending application data as fits in the caller's buffer
+static void process_copy_data(mitls_state *state, mitls_process_ctx *ctx, size_t data_cap)
+{
+  size_t n = state->data.length - state->data_pos;
+  if (n > data_cap - ctx->data_len) n = data_cap - ctx->data_len;
+  if (n) {
+    memcpy(ctx->data + ctx->data_len, state->data.data + state->data_pos, n);
+    ctx->data_len += n;
+    state->data_pos += n;
+  }
+}
+
+#ifdef _KERNEL_MODE
+typedef struct {
+    mitls_state *state;
+    FFI_process_result *r;
+} mitls_process_state;
+
+static VOID mitls_process_callout(PVOID Parameter)
+{
+    mitls_process_state *s = (mitls_process_state*)Parameter;
+    *s->r = FFI_ffiProcess(s->state->cxn);
+}
+#endif
+
+// Called by the host app with the bytes received on the socket, if any
+int MITLS_CALLCONV FFI_mitls_process(/* in */ mitls_state *state, /* in/out */ mitls_process_ctx *ctx)
+{
+  int r = 1;
+  size_t output_cap = (ctx->output == NULL) ? 0 : ctx->output_len;
+  size_t data_cap = (ctx->data == NULL) ? 0 : ctx->data_len;
+
+  ctx->output_len = 0;
+  ctx->data_len = 0;
+  ctx->tls_error = 0;
+  ctx->consumed_bytes = 0;
+  ctx->to_be_written = 0;
+  ctx->to_be_read = 0;
+  ctx->flags = 0;
+  if (!state->is_process) {
+    ctx->tls_error = 0x0250; // Internal error: FFI_mitls_process_start was not called
+    return 0;
+  }
+
+  LOCK_MUTEX(&state->lock);
+  ENTER_STATS(state);
+  ENTER_HEAP_REGION(state->rgn);
+  SET_CURRENT_STATE(state);
+  state->in = ctx->input;
+  state->in_len = (ctx->input == NULL) ? 0 : ctx->input_len;
+  state->in_pos = 0;
+
+  // Application data left over from the previous call comes first, and
+  // no further input is processed until it has all been returned.
+  process_copy_data(state, ctx, data_cap);
+  while (r && !state->is_closed && state->data_pos == state->data.length) {
+    FFI_process_result res;
+#ifdef _KERNEL_MODE
+    mitls_process_state s = {.state = state, .r = &res };
+    NTSTATUS status = KeExpandKernelStackAndCallout(mitls_process_callout, &s, MAXIMUM_EXPANSION_SIZE);
+    if (!NT_SUCCESS(status)) {
+      KRML_HOST_PRINTF("KeExpandKernelCallstackAndCallout for mitls_process_callout failed st=%x", status);
+      ctx->tls_error = 0x0250; // Internal error
+      r = 0;
+      break;
+    }
+#else
+    res = FFI_ffiProcess(state->cxn);
+#endif
+    if (res.tag == FFI_PWouldBlock) {
+      if (ATOMIC_LOAD_PTR(&state->cert_token) != NULL && ATOMIC_LOAD(&state->cert_done) == CERT_DONE) {
+        continue; // completed while suspended: resume the handshake
+      }
+      ctx->flags |= TFLAG_WOULD_BLOCK;
+      break;
+    } else if (res.tag == FFI_PComplete) {
+      state->is_complete = 1;
+      handshake_ended(state, 1);
+    } else if (res.tag == FFI_PData) {
+      state->data = res.val.case_PData;
+      state->data_pos = 0;
+      process_copy_data(state, ctx, data_cap);
+    } else if (res.tag == FFI_PClose) {
+      state->is_closed = 1;
+      handshake_ended(state, 0); // unless it completed
+    } else {
+      int err = res.val.case_PError;
+      ctx->tls_error = (err > 0) ? (uint16_t)err : 0x0250;
+      handshake_ended(state, 0);
+      r = 0;
+    }
+  }
+  ctx->consumed_bytes = state->in_pos;
+  state->in = NULL;
+  state->in_len = 0;
+  state->in_pos = 0;
+
+  // Records produced by this call, or queued by FFI_mitls_send
+  size_t n = state->out_len - state->out_pos;
+  if (n > output_cap) n = output_cap;
+  if (n) {
+    memcpy(ctx->output, state->out + state->out_pos, n);
+    state->out_pos += n;
+  }
+  if (state->out_pos == state->out_len) {
+    state->out_pos = state->out_len = 0;
+  }
+  ctx->output_len = n;
+  ctx->to_be_written = state->out_len - state->out_pos;
+  ctx->to_be_read = state->data.length - state->data_pos;
+
+  if (ctx->to_be_read) ctx->flags |= TFLAG_DATA_PENDING;
+  if (state->is_complete) ctx->flags |= TFLAG_COMPLETE;
+  if (state->is_closed) ctx->flags |= TFLAG_CLOSED;
+  if (!r || state->is_closed) {
+    cert_cancel(state); // the handshake will not resume
+  }
+  if (ATOMIC_LOAD_PTR(&state->cert_token) != NULL) ctx->flags |= TFLAG_CERT_PENDING;
+  SET_CURRENT_STATE(NULL);
+  LEAVE_HEAP_REGION();
+  LEAVE_STATS();
+  if (HAD_OUT_OF_MEMORY) {
+    cert_cancel(state);
+    handshake_out_of_memory(state);
+  }
+  UNLOCK_MUTEX(&state->lock);
+  if (HAD_OUT_OF_MEMORY) {
+    ctx->tls_error = 0x0250; // Internal error
+    return 0;
+  }
+  return r;
+}
+
+// Called by the host app, from any thread, once a pending signature is ready
+int MITLS_CALLCONV FFI_mitls_cert_complete(/* in */ mitls_state *state, const void *token, size_t sig_len)
+{
+  // Claim the completion first, so that a concurrent call cannot also write cert_result
+  if (token == NULL || !ATOMIC_CLAIM(&state->cert_done, CERT_WAITING, CERT_COMPLETING)) {
+    return 0;
+  }
+  if (token != ATOMIC_LOAD_PTR(&state->cert_token)) {
+    ATOMIC_STORE(&state->cert_done, CERT_WAITING);
+    return 0;
+  }
+  state->cert_result = (sig_len <= MAX_SIGNATURE_LEN) ? sig_len : 0;
+  ATOMIC_STORE(&state->cert_done, CERT_DONE);
+  return 1;
+}
+
 static int get_exporter(Connection_connection cxn, int early, /* out */ mitls_secret *secret)
 {
   FStar_Pervasives_Native_option__K___Spec_Hash_Definitions_hash_alg_EverCrypt_aead_alg_FStar_Bytes_bytes ret;
@@ -870,16 +1661,65 @@ void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* out */ s
     return (void*)ret.data; // bugbug: casting away const
 }
 
+static void get_stats(HEAP_REGION rgn, const mitls_stats *counters, /* out */ mitls_stats *stats)
+{
+    size_t current = 0, peak = 0;
+    *stats = *counters;
+    HeapRegionGetStatistics(rgn, &current, &peak);
+    stats->heap_bytes = current;
+    stats->heap_peak_bytes = peak;
+}
+
+// Waits for the current call on the state, if any
+int MITLS_CALLCONV FFI_mitls_get_stats(/* in */ mitls_state *state, /* out */ mitls_stats *stats)
+{
+    LOCK_MUTEX(&state->lock);
+    get_stats(state->rgn, &state->stats, stats);
+    UNLOCK_MUTEX(&state->lock);
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_get_global_metrics(/* in/out */ mitls_global_metrics *metrics)
+{
+    mitls_global_metrics m;
+    size_t size = metrics->size, current = 0, peak = 0;
+    if (size < offsetof(mitls_global_metrics, handshakes_started) + sizeof(uint64_t)) {
+        return 0;
+    }
+    Metrics_get(&m);
+    HeapRegionGetStatistics(NULL, &current, &peak);
+    m.global_heap_bytes = current;
+    m.global_heap_peak_bytes = peak;
+    if (size > sizeof(m)) size = sizeof(m);
+    m.size = (uint32_t)size;
+    memcpy(metrics, &m, size);
+    return 1;
+}
+
+size_t MITLS_CALLCONV FFI_mitls_format_global_metrics(/* out */ char *buffer, size_t buffer_len)
+{
+    mitls_global_metrics m;
+    m.size = sizeof(m);
+    FFI_mitls_get_global_metrics(&m);
+    return Metrics_format(&m, buffer, buffer_len);
+}
+
 /*************************************************************************
 * QUIC API
 **************************************************************************/
 
 typedef struct quic_state {
    HEAP_REGION rgn;
+   mitls_config *shared; // may be NULL
    uint8_t is_server;
    uint8_t is_complete;
    uint8_t is_post_hs;
+   uint8_t hs_started; // counted in the global metrics
+   uint8_t hs_ended;   // counted in the global metrics
    Old_Handshake_hs hs;
+   mitls_lock lock;    // serializes the calls that count into stats
+   mitls_stats stats;
+   uint64_t hs_start;  // from Metrics_handshake_started, 0 in kernel mode
 } quic_state;
 
 static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_config *cfg)
@@ -926,9 +1766,8 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
         FStar_Bytes_bytes key;
         bool b;
         MakeFStar_Bytes_bytes(&key, cfg->ticket_key, cfg->ticket_key_len);
-        LOCK_MUTEX(&lock);
+        // No-op, without locking, if the key is already current
         FFI_ffiSetTicketKey(cfg->ticket_enc_alg, key);
-        UNLOCK_MUTEX(&lock);
     }
 
     if(cfg->server_ticket && cfg->server_ticket->ticket_len > 0) {
@@ -958,6 +1797,7 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
       cbs->cb_state = cfg->callback_state;
       cbs->select = cfg->cert_callbacks->select;
       cbs->format = cfg->cert_callbacks->format;
+      cbs->get_chain = NULL;
       cbs->sign = cfg->cert_callbacks->sign;
       cbs->verify = cfg->cert_callbacks->verify;
 
@@ -1007,6 +1847,74 @@ int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *
     }
     
     st->rgn = rgn;
+    INIT_LOCK(&st->lock);
+    st->hs_start = Metrics_handshake_started();
+    st->hs_started = 1;
+    *state = st;
+    return 1;
+}
+
+// Called by the host app to build a QUIC config once, to be shared by
+// many connections with FFI_mitls_quic_create_shared
+int MITLS_CALLCONV FFI_mitls_quic_config_create(/* out */ mitls_config **config, const quic_config *cfg)
+{
+    mitls_config *c = NULL;
+    *config = NULL;
+    HEAP_REGION rgn;
+
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+
+    c = KRML_HOST_CALLOC(1, sizeof(mitls_config));
+    if (c) {
+      Prims_string host_name = CopyPrimsString(cfg->host_name != NULL ? cfg->host_name : "");
+      TLSConstants_config config0 = QUIC_ffiConfig((FStar_Bytes_bytes){.data=host_name,.length=strlen(host_name)});
+      c->cfg = quic_set_config(config0, cfg);
+      c->is_server = cfg->is_server;
+      c->refs = 1;
+      c->rgn = rgn;
+    }
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY || c == NULL) {
+      DESTROY_HEAP_REGION(rgn);
+      return 0;
+    }
+    *config = c;
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_quic_create_shared(quic_state **state, mitls_config *config)
+{
+    quic_state* st = NULL;
+    *state = NULL;
+    HEAP_REGION rgn;
+
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+
+    st = KRML_HOST_CALLOC(1, sizeof(quic_state));
+    if (st) {
+      st->is_server = config->is_server;
+      st->shared = config;
+      st->hs = QUIC_create_hs(st->is_server, config->cfg);
+    }
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY || st == NULL) {
+      DESTROY_HEAP_REGION(rgn);
+      return 0;
+    }
+
+    REF_INCREMENT(&config->refs);
+    st->rgn = rgn;
+    INIT_LOCK(&st->lock);
+    st->hs_start = Metrics_handshake_started();
+    st->hs_started = 1;
     *state = st;
     return 1;
 }
@@ -1025,9 +1933,21 @@ static VOID quic_process_callout(PVOID Parameter)
 }
 #endif
 
+// As handshake_ended, in the heap region of st
+static void quic_handshake_ended(quic_state *st, int ok)
+{
+  if (!st->hs_ended) {
+    Old_Handshake_summary s = QUIC_get_summary(st->hs);
+    st->hs_ended = 1;
+    count_handshake(ok, st->hs_start, &s);
+  }
+}
+
 int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
 {
   int r = 0;
+  LOCK_MUTEX(&st->lock);
+  ENTER_STATS(st);
   ENTER_HEAP_REGION(st->rgn);
   unsigned char z = 0;
   
@@ -1045,8 +1965,8 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
   
   if (!NT_SUCCESS(status)) {
     KRML_HOST_PRINTF("KeExpandKernelCallstackAndCallout for quic_process_callout failed st=%x", status);
-    ctx->tls_error = 0x0350; // Internal error
-    return 0;
+    res.tag = QUIC_HS_ERROR;
+    res.val.case_HS_ERROR = 0x0350; // Internal error
   }
 #else
   QUIC_hs_result res = QUIC_process_hs(st->hs, in);
@@ -1062,7 +1982,10 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
     if(ctx->output != NULL && ctx->output_len)
       memcpy(ctx->output, out.output.data, ctx->output_len);
     
-    if(out.is_complete) st->is_complete = 1;
+    if(out.is_complete) {
+      st->is_complete = 1;
+      quic_handshake_ended(st, 1);
+    }
     if(out.is_writable) ctx->flags |= QFLAG_APPLICATION_KEY;
     if(out.is_early_rejected) ctx->flags |= QFLAG_REJECTED_0RTT;
     if(out.is_post_handshake) st->is_post_hs = 1;
@@ -1073,6 +1996,7 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
     ctx->tls_error = res.val.case_HS_ERROR;
     ctx->output_len = 0;
     ctx->consumed_bytes = 0;
+    quic_handshake_ended(st, 0);
   }
 
   K___Prims_int_Prims_int epochs = QUIC_get_epochs(st->hs);
@@ -1082,6 +2006,12 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
   if(st->is_post_hs) ctx->flags |= QFLAG_POST_HANDSHAKE;
   
   LEAVE_HEAP_REGION();
+  LEAVE_STATS();
+  if (HAD_OUT_OF_MEMORY && !st->hs_ended) {
+    st->hs_ended = 1;
+    count_handshake(0, st->hs_start, NULL);
+  }
+  UNLOCK_MUTEX(&st->lock);
   return r;
 }
 
@@ -1090,6 +2020,8 @@ int MITLS_CALLCONV FFI_mitls_quic_get_record_key(quic_state *st, quic_raw_key *k
   int res = 0;
   FStar_Pervasives_Native_option__QUIC_raw_key r;
   
+  LOCK_MUTEX(&st->lock);
+  ENTER_STATS(st);
   ENTER_HEAP_REGION(st->rgn);
   r = QUIC_get_key(st->hs, epoch, (int)rw);
   
@@ -1104,6 +2036,8 @@ int MITLS_CALLCONV FFI_mitls_quic_get_record_key(quic_state *st, quic_raw_key *k
   }
   
   LEAVE_HEAP_REGION();
+  LEAVE_STATS();
+  UNLOCK_MUTEX(&st->lock);
   return res;
 }
 
@@ -1112,6 +2046,8 @@ int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *st, quic_secret
   int res = 0;
   FStar_Pervasives_Native_option__Old_KeySchedule_raw_rekey_secrets r;
   
+  LOCK_MUTEX(&st->lock);
+  ENTER_STATS(st);
   ENTER_HEAP_REGION(st->rgn);
   r = QUIC_get_secrets(st->hs);
   
@@ -1126,12 +2062,16 @@ int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *st, quic_secret
   }
   
   LEAVE_HEAP_REGION();
+  LEAVE_STATS();
+  UNLOCK_MUTEX(&st->lock);
   return res;
 }
 
 int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *st, const unsigned char *ticket_data, size_t ticket_data_len)
 {
   int r = 0;
+  LOCK_MUTEX(&st->lock);
+  ENTER_STATS(st);
   ENTER_HEAP_REGION(st->rgn);
   FStar_Bytes_bytes data = {
    .data = KRML_HOST_MALLOC(ticket_data_len),
@@ -1140,16 +2080,36 @@ int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *st, const unsigned cha
   memcpy((unsigned char*)data.data, ticket_data, ticket_data_len);
   r = QUIC_send_ticket(st->hs, data);
   LEAVE_HEAP_REGION();
+  LEAVE_STATS();
+  UNLOCK_MUTEX(&st->lock);
   return r;
 }
 
+// Waits for the current call on the state, if any
+int MITLS_CALLCONV FFI_mitls_quic_get_stats(quic_state *st, mitls_stats *stats)
+{
+  LOCK_MUTEX(&st->lock);
+  get_stats(st->rgn, &st->stats, stats);
+  UNLOCK_MUTEX(&st->lock);
+  return 1;
+}
+
 void MITLS_CALLCONV FFI_mitls_quic_free(quic_state *state)
 {
     HEAP_REGION rgn = state->rgn;
+    mitls_config *shared = state->shared;
+    // A connection dropped during its handshake is counted as failed
+    if (state->hs_started && !state->hs_ended) {
+        state->hs_ended = 1;
+        count_handshake(0, state->hs_start, NULL);
+    }
+    DESTROY_LOCK(&state->lock);
     ENTER_HEAP_REGION(state->rgn);
     KRML_HOST_FREE(state);
     LEAVE_HEAP_REGION();
+    KeyPool_release(rgn);
     DESTROY_HEAP_REGION(rgn);
+    FFI_mitls_config_release(shared);
 }
 
 
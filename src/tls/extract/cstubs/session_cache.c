@@ -0,0 +1,383 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Native implementation of SessionCache.fsti
+//
+// A fixed number of shards, each with its own lock, hash table and
+// LRU list. Entries are allocated outside of the heap regions of
+// connections (they outlive the connection that inserts them), and
+// values are copied into the region of the connection that looks
+// them up. As in locks.c, all the state is statically initialized.
+
+#define SHARDS 16
+#define MIN_BUCKETS 64
+#define DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+#define DEFAULT_LIFETIME (7 * 24 * 3600) // the longest ticket lifetime of TLS 1.3
+#define STORE_BUFFER 512 // first attempt at reading values from the store
+
+#if IS_WINDOWS
+  #ifdef _KERNEL_MODE
+    typedef EX_PUSH_LOCK cache_lock;
+    #define LOCK(x) ExfAcquirePushLockExclusive(&x)
+    #define UNLOCK(x) ExfReleasePushLockExclusive(&x)
+    #define LOCK_INITIALIZER 0
+    #define CACHE_ALLOC(n) ExAllocatePoolWithTag(NonPagedPool, n, 'cSlM')
+    #define CACHE_FREE(p) ExFreePoolWithTag(p, 'cSlM')
+    static uint64_t now(void)
+    {
+      LARGE_INTEGER t;
+      KeQuerySystemTime(&t);
+      return t.QuadPart / 10000000;
+    }
+  #else
+    typedef SRWLOCK cache_lock;
+    #define LOCK(x) AcquireSRWLockExclusive(&x)
+    #define UNLOCK(x) ReleaseSRWLockExclusive(&x)
+    #define LOCK_INITIALIZER SRWLOCK_INIT
+    #define CACHE_ALLOC(n) malloc(n)
+    #define CACHE_FREE(p) free(p)
+    static uint64_t now(void) { return GetTickCount64() / 1000; }
+  #endif
+#else
+typedef pthread_mutex_t cache_lock;
+#define LOCK(x) pthread_mutex_lock(&x)
+#define UNLOCK(x) pthread_mutex_unlock(&x)
+#define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define CACHE_ALLOC(n) malloc(n)
+#define CACHE_FREE(p) free(p)
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+#endif
+
+// The key and value are stored after the entry
+typedef struct cache_entry {
+  uint64_t hash;
+  uint64_t expires;
+  uint8_t table;
+  uint32_t key_len;
+  uint32_t value_len;
+  struct cache_entry *next; // in bucket
+  struct cache_entry *lru_prev, *lru_next; // most recently used first
+} cache_entry;
+
+#define ENTRY_KEY(e) ((char*)((e) + 1))
+#define ENTRY_VALUE(e) (ENTRY_KEY(e) + (e)->key_len)
+#define ENTRY_SIZE(e) (sizeof(cache_entry) + (e)->key_len + (e)->value_len)
+
+typedef struct {
+  cache_lock lock;
+  cache_entry **buckets; // allocated on first insert
+  size_t mask;
+  cache_entry *lru_head, *lru_tail;
+  size_t max_bytes;
+  uint64_t lifetime;
+  mitls_session_cache_stats stats;
+} cache_shard;
+
+#define SHARD_INIT { .lock = LOCK_INITIALIZER, .max_bytes = DEFAULT_MAX_BYTES / SHARDS, .lifetime = DEFAULT_LIFETIME }
+
+static cache_shard shards[SHARDS] = {
+  SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT,
+  SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT,
+  SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT,
+  SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+};
+
+// Optional external store (see FFI_mitls_configure_session_store), set
+// before connections are created: the local cache is read through and
+// written through to the store
+static mitls_session_store store;
+static void *store_state;
+
+// FNV-1a over the table tag and the key
+static uint64_t hash_key(uint8_t table, const char *key, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  h = (h ^ table) * 0x100000001b3ULL;
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)key[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+#define SHARD_OF(h) (shards + ((h) % SHARDS))
+#define BUCKET_OF(s, h) ((s)->buckets + (((h) / SHARDS) & (s)->mask))
+
+static void lru_unlink(cache_shard *s, cache_entry *e)
+{
+  if(e->lru_prev) e->lru_prev->lru_next = e->lru_next; else s->lru_head = e->lru_next;
+  if(e->lru_next) e->lru_next->lru_prev = e->lru_prev; else s->lru_tail = e->lru_prev;
+}
+
+static void lru_push(cache_shard *s, cache_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = s->lru_head;
+  if(s->lru_head) s->lru_head->lru_prev = e; else s->lru_tail = e;
+  s->lru_head = e;
+}
+
+static cache_entry **find(cache_shard *s, uint64_t h, uint8_t table, const char *key, size_t len)
+{
+  cache_entry **p = BUCKET_OF(s, h);
+  for(; *p; p = &(*p)->next)
+  {
+    cache_entry *e = *p;
+    if(e->hash == h && e->table == table && e->key_len == len && !memcmp(ENTRY_KEY(e), key, len))
+      break;
+  }
+  return p;
+}
+
+static void remove_entry(cache_shard *s, cache_entry *e)
+{
+  cache_entry **p = find(s, e->hash, e->table, ENTRY_KEY(e), e->key_len);
+  *p = e->next;
+  lru_unlink(s, e);
+  s->stats.entries--;
+  s->stats.bytes -= ENTRY_SIZE(e);
+  CACHE_FREE(e);
+}
+
+static void evict(cache_shard *s)
+{
+  while(s->lru_tail && s->stats.bytes > s->max_bytes)
+  {
+    remove_entry(s, s->lru_tail);
+    s->stats.evictions++;
+  }
+}
+
+// Keeps at most 2 entries per bucket on average; allocation failures are
+// not fatal, the chains only get longer
+static int grow(cache_shard *s)
+{
+  size_t old = s->buckets ? s->mask + 1 : 0;
+  if(old && s->stats.entries < 2 * old) return 1;
+
+  size_t size = old ? 2 * old : MIN_BUCKETS;
+  cache_entry **b = CACHE_ALLOC(size * sizeof(cache_entry*));
+  if(!b) return old != 0;
+  memset(b, 0, size * sizeof(cache_entry*));
+
+  cache_entry **prev = s->buckets;
+  s->buckets = b;
+  s->mask = size - 1;
+  for(size_t i = 0; i < old; i++)
+  {
+    for(cache_entry *e = prev[i], *next; e; e = next)
+    {
+      cache_entry **p = BUCKET_OF(s, e->hash);
+      next = e->next;
+      e->next = *p;
+      *p = e;
+    }
+  }
+  if(prev) CACHE_FREE(prev);
+  return 1;
+}
+
+// Adds the entry to the local cache, returns its lifetime
+static uint32_t insert_local(uint8_t table, const char *key, size_t key_len, const char *v, size_t v_len)
+{
+  uint64_t h = hash_key(table, key, key_len);
+  cache_shard *s = SHARD_OF(h);
+  cache_entry *e = CACHE_ALLOC(sizeof(cache_entry) + key_len + v_len);
+  if(!e) return 0; // a cache may drop entries
+
+  e->hash = h;
+  e->table = table;
+  e->key_len = key_len;
+  e->value_len = v_len;
+  memcpy(ENTRY_KEY(e), key, key_len);
+  memcpy(ENTRY_VALUE(e), v, v_len);
+
+  LOCK(s->lock);
+  if(!grow(s))
+  {
+    UNLOCK(s->lock);
+    CACHE_FREE(e);
+    return 0;
+  }
+
+  cache_entry **p = find(s, h, table, key, key_len);
+  if(*p) remove_entry(s, *p);
+
+  uint32_t lifetime = (uint32_t)s->lifetime;
+  e->expires = now() + lifetime;
+  p = BUCKET_OF(s, h);
+  e->next = *p;
+  *p = e;
+  lru_push(s, e);
+  s->stats.inserts++;
+  s->stats.entries++;
+  s->stats.bytes += ENTRY_SIZE(e);
+  evict(s);
+  UNLOCK(s->lock);
+  return lifetime;
+}
+
+void SessionCache_insert(uint8_t table, FStar_Bytes_bytes key, FStar_Bytes_bytes v)
+{
+  uint32_t lifetime = insert_local(table, key.data, key.length, v.data, v.length);
+
+  // Written through, even if the local cache dropped the entry
+  if(store.put)
+    store.put(store_state, (mitls_session_kind)table, (const unsigned char*)key.data, key.length,
+      (const unsigned char*)v.data, v.length, lifetime ? lifetime : DEFAULT_LIFETIME);
+}
+
+// Reads a value missing from the local cache from the external store, into a
+// buffer allocated with CACHE_ALLOC, and caches it locally
+static char *store_get(uint8_t table, FStar_Bytes_bytes key, size_t *len)
+{
+  unsigned char buf[STORE_BUFFER];
+  unsigned char *v = buf;
+  size_t n = store.get(store_state, (mitls_session_kind)table,
+    (const unsigned char*)key.data, key.length, buf, sizeof(buf));
+
+  // Too large for buf: ask again with a buffer of the right size
+  if(n > sizeof(buf))
+  {
+    size_t m = n;
+    if(!(v = CACHE_ALLOC(m))) return NULL;
+    n = store.get(store_state, (mitls_session_kind)table,
+      (const unsigned char*)key.data, key.length, v, m);
+    if(n > m) n = 0; // changed in between
+  }
+
+  cache_shard *s = SHARD_OF(hash_key(table, key.data, key.length));
+  char *r = n ? CACHE_ALLOC(n) : NULL;
+  if(r)
+  {
+    memcpy(r, v, n);
+    insert_local(table, key.data, key.length, r, n);
+  }
+  if(v != buf) CACHE_FREE(v);
+
+  LOCK(s->lock);
+  if(r) s->stats.store_hits++; else s->stats.store_misses++;
+  UNLOCK(s->lock);
+
+  *len = n;
+  return r;
+}
+
+FStar_Bytes_bytes SessionCache_lookup(uint8_t table, FStar_Bytes_bytes key)
+{
+  uint64_t h = hash_key(table, key.data, key.length);
+  cache_shard *s = SHARD_OF(h);
+  char *tmp = NULL;
+  size_t len = 0;
+
+  LOCK(s->lock);
+  cache_entry *e = s->buckets ? *find(s, h, table, key.data, key.length) : NULL;
+
+  if(e && e->expires <= now())
+  {
+    remove_entry(s, e);
+    s->stats.expirations++;
+    e = NULL;
+  }
+
+  // Copied twice, as KRML_HOST_MALLOC may not return (out of memory in
+  // a heap region) and must not be called with the lock held
+  if(e && (tmp = CACHE_ALLOC(e->value_len)))
+  {
+    lru_unlink(s, e);
+    lru_push(s, e);
+    s->stats.hits++;
+    len = e->value_len;
+    memcpy(tmp, ENTRY_VALUE(e), len);
+  }
+  else s->stats.misses++;
+  UNLOCK(s->lock);
+
+  if(!tmp && store.get)
+    tmp = store_get(table, key, &len);
+
+  if(!tmp) return FStar_Bytes_empty_bytes;
+
+  char *data = KRML_HOST_MALLOC(len);
+  if(data == NULL)
+    KRML_HOST_EXIT(255);
+  memcpy(data, tmp, len);
+  CACHE_FREE(tmp);
+
+  FStar_Bytes_bytes r = {.length = len, .data = data};
+  return r;
+}
+
+void SessionCache_remove(uint8_t table, FStar_Bytes_bytes key)
+{
+  uint64_t h = hash_key(table, key.data, key.length);
+  cache_shard *s = SHARD_OF(h);
+
+  LOCK(s->lock);
+  cache_entry *e = s->buckets ? *find(s, h, table, key.data, key.length) : NULL;
+  if(e) remove_entry(s, e);
+  UNLOCK(s->lock);
+
+  if(store.del)
+    store.del(store_state, (mitls_session_kind)table, (const unsigned char*)key.data, key.length);
+}
+
+// Not part of SessionCache.fsti: used by FFI_mitls_configure_session_store
+void SessionCache_set_store(void *cb_state, const mitls_session_store *st)
+{
+  store_state = cb_state;
+  if(st) store = *st;
+  else memset(&store, 0, sizeof(store));
+}
+
+// Not part of SessionCache.fsti: used by FFI_mitls_configure_session_cache
+void SessionCache_configure(size_t max_bytes, uint32_t lifetime)
+{
+  for(int i = 0; i < SHARDS; i++)
+  {
+    cache_shard *s = shards + i;
+    LOCK(s->lock);
+    if(max_bytes) s->max_bytes = max_bytes / SHARDS;
+    if(lifetime) s->lifetime = lifetime;
+    evict(s);
+    UNLOCK(s->lock);
+  }
+}
+
+// Not part of SessionCache.fsti: used by FFI_mitls_get_session_cache_stats
+void SessionCache_get_stats(mitls_session_cache_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for(int i = 0; i < SHARDS; i++)
+  {
+    cache_shard *s = shards + i;
+    LOCK(s->lock);
+    stats->hits += s->stats.hits;
+    stats->misses += s->stats.misses;
+    stats->inserts += s->stats.inserts;
+    stats->evictions += s->stats.evictions;
+    stats->expirations += s->stats.expirations;
+    stats->entries += s->stats.entries;
+    stats->bytes += s->stats.bytes;
+    stats->store_hits += s->stats.store_hits;
+    stats->store_misses += s->stats.store_misses;
+    UNLOCK(s->lock);
+  }
+}
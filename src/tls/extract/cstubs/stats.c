@@ -0,0 +1,146 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <time.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Native implementation of Stats.fsti
+//
+// The counters are those of the mitls_stats of the connection that the
+// current thread is processing, set by the FFI with Stats_enter. They
+// are only updated by the calls on the connection, which are serialized,
+// so they are plain fields. Outside of these calls nothing is counted,
+// and the clock is not even read. There is no thread-local storage in
+// kernel mode, where nothing is counted. Stats_clock is also used by the
+// global metrics of metrics.c.
+
+#define STATS_CERTIFICATE 3 // the phase timed by mitlsffi.c
+
+#if IS_WINDOWS && defined(_KERNEL_MODE)
+
+uint64_t Stats_clock(void)
+{
+  return 0;
+}
+
+mitls_stats *Stats_enter(mitls_stats *stats)
+{
+  return NULL;
+}
+
+uint64_t Stats_start(void)
+{
+  return 0;
+}
+
+void Stats_stop(uint8_t p, uint64_t t0)
+{
+}
+
+void Stats_record_encrypted(uint32_t len)
+{
+}
+
+void Stats_record_decrypted(uint32_t len)
+{
+}
+
+void Stats_messages_sent(uint32_t n)
+{
+}
+
+void Stats_messages_received(uint32_t n)
+{
+}
+
+#else
+
+#if IS_WINDOWS
+static __declspec(thread) mitls_stats *current = NULL;
+static LARGE_INTEGER frequency;
+
+// Nanoseconds of a monotonic clock
+uint64_t Stats_clock(void)
+{
+  LARGE_INTEGER c;
+  if(frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&c);
+  uint64_t f = (uint64_t)frequency.QuadPart, t = (uint64_t)c.QuadPart;
+  return (t / f) * 1000000000 + (t % f) * 1000000000 / f;
+}
+#else
+static __thread mitls_stats *current = NULL;
+
+// Nanoseconds of a monotonic clock
+uint64_t Stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// Counts into stats (or nothing if NULL), and returns the previous counters
+mitls_stats *Stats_enter(mitls_stats *stats)
+{
+  mitls_stats *previous = current;
+  current = stats;
+  return previous;
+}
+
+uint64_t Stats_start(void)
+{
+  return current ? Stats_clock() : 0;
+}
+
+void Stats_stop(uint8_t p, uint64_t t0)
+{
+  mitls_stats *s = current;
+  if(s == NULL || t0 == 0) return;
+  uint64_t d = Stats_clock() - t0;
+  switch(p)
+  {
+    case 0: s->key_exchange_ns += d; break;
+    case 1: s->key_schedule_ns += d; break;
+    case 2: s->transcript_ns += d; break;
+    case STATS_CERTIFICATE: s->certificate_ns += d; break;
+  }
+}
+
+void Stats_record_encrypted(uint32_t len)
+{
+  mitls_stats *s = current;
+  if(s == NULL) return;
+  s->records_encrypted++;
+  s->bytes_encrypted += len;
+}
+
+void Stats_record_decrypted(uint32_t len)
+{
+  mitls_stats *s = current;
+  if(s == NULL) return;
+  s->records_decrypted++;
+  s->bytes_decrypted += len;
+}
+
+void Stats_messages_sent(uint32_t n)
+{
+  if(current) current->messages_sent += n;
+}
+
+void Stats_messages_received(uint32_t n)
+{
+  if(current) current->messages_received += n;
+}
+
+#endif
@@ -0,0 +1,318 @@
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#endif
+
+#include <stdarg.h>
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Native implementation of Trace.fsti
+//
+// The levels are one byte per module, read without a lock by every
+// trace; they are statically verbose, as the internal tests do not go
+// through FFI_mitls_init.
+//
+// The traces of the F* modules (Trace.print and Trace.dump) are printed
+// by the calling thread through KRML_HOST_PRINTF, or, once
+// FFI_mitls_set_trace_ring is called, copied into a ring of fixed-size
+// records and printed by a background thread through KRML_HOST_PRINTF,
+// so the ring does not depend on log_to_choice.h. It is not available
+// in kernel mode. Dumps are queued as raw bytes: they are only
+// hex-encoded by that thread, and only queued dumps are truncated.
+
+#define RECORD_DATA 256 // as in TracePrintf
+#define LABEL_LEN 32
+#define LINE_DATA 64 // bytes per line of a dump printed directly
+
+static const char *tags[TLS_trace_modules] = {
+  "AEP", "CDH", "EPO", "FFI", "HS ", "HSL", "KS ", "NGO", "QIC", "RNG", "TCK", "TLS", "REC"
+};
+
+static volatile uint8_t levels[TLS_trace_modules] = {
+  TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose,
+  TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose,
+  TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose, TLS_trace_verbose,
+  TLS_trace_verbose
+};
+
+bool Trace_enabled(uint8_t m, uint8_t l)
+{
+  return m < TLS_trace_modules && levels[m] >= l;
+}
+
+void Trace_set_level(int m, int l)
+{
+  if(m == TLS_trace_all)
+  {
+    for(int i = 0; i < TLS_trace_modules; i++) levels[i] = (uint8_t)l;
+  }
+  else if(m >= 0 && m < TLS_trace_modules)
+  {
+    levels[m] = (uint8_t)l;
+  }
+}
+
+typedef struct {
+  uint8_t module;
+  uint8_t text; // data is the message of a Trace.print, not a dump
+  uint32_t len; // of a dump, truncated to RECORD_DATA
+  uint32_t full_len;
+  char label[LABEL_LEN];
+  uint8_t data[RECORD_DATA];
+} trace_record;
+
+#define HEX_LEN (2 * RECORD_DATA + 1)
+
+// hex must hold 2 * len + 1 characters
+static void format_hex(char *hex, const uint8_t *data, size_t len)
+{
+  static const char digits[] = "0123456789abcdef";
+  for(size_t i = 0; i < len; i++)
+  {
+    hex[2 * i] = digits[data[i] >> 4];
+    hex[2 * i + 1] = digits[data[i] & 15];
+  }
+  hex[2 * len] = 0;
+}
+
+static void make_dump(trace_record *r, uint8_t m, Prims_string label, FStar_Bytes_bytes b)
+{
+  size_t n = strlen(label);
+  if(n >= LABEL_LEN) n = LABEL_LEN - 1;
+  memcpy(r->label, label, n);
+  r->label[n] = 0;
+  r->module = m;
+  r->text = 0;
+  r->full_len = b.length;
+  r->len = b.length < RECORD_DATA ? b.length : RECORD_DATA;
+  memcpy(r->data, b.data, r->len);
+}
+
+#if !(IS_WINDOWS && defined(_KERNEL_MODE))
+
+#if IS_WINDOWS
+  typedef SRWLOCK trace_lock;
+  #define LOCK(x) AcquireSRWLockExclusive(&x)
+  #define UNLOCK(x) ReleaseSRWLockExclusive(&x)
+  #define WAIT(c, x) SleepConditionVariableSRW(&c, &x, INFINITE, 0)
+  #define SIGNAL(c) WakeConditionVariable(&c)
+  #define LOCK_INITIALIZER SRWLOCK_INIT
+  static CONDITION_VARIABLE not_empty = CONDITION_VARIABLE_INIT;
+  static HANDLE reader_thread;
+  static DWORD WINAPI reader(LPVOID arg);
+  static int start_reader(void)
+  {
+    reader_thread = CreateThread(NULL, 0, reader, NULL, 0, NULL);
+    return reader_thread != NULL;
+  }
+  static void join_reader(void)
+  {
+    WaitForSingleObject(reader_thread, INFINITE);
+    CloseHandle(reader_thread);
+  }
+  #define READER_RETURN return 0
+#else
+  typedef pthread_mutex_t trace_lock;
+  #define LOCK(x) pthread_mutex_lock(&x)
+  #define UNLOCK(x) pthread_mutex_unlock(&x)
+  #define WAIT(c, x) pthread_cond_wait(&c, &x)
+  #define SIGNAL(c) pthread_cond_signal(&c)
+  #define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+  static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+  static pthread_t reader_thread;
+  static void *reader(void *arg);
+  static int start_reader(void)
+  {
+    return pthread_create(&reader_thread, NULL, reader, NULL) == 0;
+  }
+  static void join_reader(void)
+  {
+    pthread_join(reader_thread, NULL);
+  }
+  #define READER_RETURN return NULL
+#endif
+
+static trace_lock lock = LOCK_INITIALIZER;
+static trace_lock configure_lock = LOCK_INITIALIZER;
+static trace_record *ring;
+static size_t ring_size, head, count;
+static uint64_t dropped;
+static int stopping;
+
+// Returns 0 if the ring is stopped, and r must be printed by the caller
+static int enqueue(const trace_record *r)
+{
+  int queued = 0;
+  LOCK(lock);
+  if(ring && !stopping)
+  {
+    queued = 1;
+    if(count == ring_size)
+    {
+      dropped++;
+    }
+    else
+    {
+      ring[(head + count) % ring_size] = *r;
+      if(count++ == 0) SIGNAL(not_empty);
+    }
+  }
+  UNLOCK(lock);
+  return queued;
+}
+
+static void print_record(const trace_record *r)
+{
+  char hex[HEX_LEN];
+  if(r->text)
+  {
+    KRML_HOST_PRINTF("%s| %s\n", tags[r->module], (const char*)r->data);
+  }
+  else
+  {
+    format_hex(hex, r->data, r->len);
+    KRML_HOST_PRINTF("%s| %s: %s%s\n", tags[r->module], r->label, hex,
+      r->full_len > r->len ? "..." : "");
+  }
+}
+
+#if IS_WINDOWS
+static DWORD WINAPI reader(LPVOID arg)
+#else
+static void *reader(void *arg)
+#endif
+{
+  trace_record r;
+  (void)arg;
+
+  LOCK(lock);
+  for(;;)
+  {
+    while(!count && !stopping) WAIT(not_empty, lock);
+    if(!count) break; // stopping, and all printed
+    r = ring[head];
+    head = (head + 1) % ring_size;
+    count--;
+    uint64_t d = dropped;
+    dropped = 0;
+    UNLOCK(lock);
+
+    // Printed in order, outside of the lock
+    if(d) KRML_HOST_PRINTF("TRC| %llu traces dropped\n", (unsigned long long)d);
+    print_record(&r);
+    LOCK(lock);
+  }
+  UNLOCK(lock);
+  READER_RETURN;
+}
+
+int Trace_set_ring(size_t records)
+{
+  int r = 1;
+  LOCK(configure_lock);
+
+  if(ring)
+  {
+    LOCK(lock);
+    stopping = 1;
+    SIGNAL(not_empty);
+    UNLOCK(lock);
+    join_reader();
+
+    LOCK(lock);
+    free(ring);
+    ring = NULL;
+    ring_size = head = count = 0;
+    if(dropped) KRML_HOST_PRINTF("TRC| %llu traces dropped\n", (unsigned long long)dropped);
+    dropped = 0;
+    UNLOCK(lock);
+  }
+
+  if(records)
+  {
+    trace_record *q = malloc(records * sizeof(trace_record));
+    if(q)
+    {
+      LOCK(lock);
+      ring = q;
+      ring_size = records;
+      stopping = 0;
+      UNLOCK(lock);
+      if(!start_reader())
+      {
+        LOCK(lock);
+        ring = NULL;
+        ring_size = 0;
+        UNLOCK(lock);
+        free(q);
+        r = 0;
+      }
+    }
+    else r = 0;
+  }
+
+  UNLOCK(configure_lock);
+  return r;
+}
+
+#else
+
+static int enqueue(const trace_record *r)
+{
+  return 0;
+}
+
+int Trace_set_ring(size_t records)
+{
+  return records == 0;
+}
+
+#endif
+
+void Trace_print(uint8_t m, Prims_string s)
+{
+  trace_record r;
+  if(!Trace_enabled(m, TLS_trace_info)) return;
+  size_t n = strlen(s);
+  if(n >= RECORD_DATA) n = RECORD_DATA - 1;
+  r.module = m;
+  r.text = 1;
+  memcpy(r.data, s, n);
+  r.data[n] = 0;
+  if(enqueue(&r)) return;
+  KRML_HOST_PRINTF("%s| %s\n", tags[m], s);
+}
+
+void Trace_dump(uint8_t m, uint8_t l, Prims_string label, FStar_Bytes_bytes b)
+{
+  trace_record r;
+  if(!Trace_enabled(m, l)) return;
+  make_dump(&r, m, label, b);
+  if(enqueue(&r)) return;
+
+  // Printed in full, unlike the queued records, in lines that fit the
+  // buffer of TracePrintf; longer dumps have one line per offset
+  char hex[2 * LINE_DATA + 1];
+  const uint8_t *data = (const uint8_t*)b.data;
+  if(b.length <= LINE_DATA)
+  {
+    format_hex(hex, data, b.length);
+    KRML_HOST_PRINTF("%s| %s: %s\n", tags[m], label, hex);
+    return;
+  }
+  for(uint32_t i = 0; i < b.length; i += LINE_DATA)
+  {
+    uint32_t n = b.length - i < LINE_DATA ? b.length - i : LINE_DATA;
+    format_hex(hex, data + i, n);
+    KRML_HOST_PRINTF("%s| %s [%u]: %s\n", tags[m], label, (unsigned)i, hex);
+  }
+}
@@ -0,0 +1,10 @@
+open Prims
+
+(* The OCaml build has no background threads; the pools are always empty,
+   and TLS.Curve25519 and DHGroup generate their shares inline *)
+
+let pop_x25519 : Prims.unit -> FStar_Bytes.bytes =
+  fun () -> FStar_Bytes.empty_bytes
+
+(* pub_len stays 0 *)
+let pop_ffdhe _ _ _ _ _ _ _ _ _ = Obj.magic ()
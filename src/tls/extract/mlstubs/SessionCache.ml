@@ -0,0 +1,17 @@
+open Prims
+
+(* The OCaml build drives one connection at a time; the cache is an
+   unbounded table that never expire *)
+
+let caches : (FStar_UInt8.t * FStar_Bytes.bytes, FStar_Bytes.bytes) Hashtbl.t =
+  Hashtbl.create 64
+
+let insert : FStar_UInt8.t -> FStar_Bytes.bytes -> FStar_Bytes.bytes -> Prims.unit =
+  fun t k v -> Hashtbl.replace caches (t, k) v
+
+let lookup : FStar_UInt8.t -> FStar_Bytes.bytes -> FStar_Bytes.bytes =
+  fun t k ->
+    try Hashtbl.find caches (t, k) with Not_found -> FStar_Bytes.empty_bytes
+
+let remove : FStar_UInt8.t -> FStar_Bytes.bytes -> Prims.unit =
+  fun t k -> Hashtbl.remove caches (t, k)
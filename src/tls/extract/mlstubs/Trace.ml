@@ -0,0 +1,35 @@
+open Prims
+
+(* The OCaml build traces everything that DebugFlags keeps *)
+
+let aep = FStar_UInt8.uint_to_t (Prims.parse_int "0")
+let cdh = FStar_UInt8.uint_to_t (Prims.parse_int "1")
+let epo = FStar_UInt8.uint_to_t (Prims.parse_int "2")
+let ffi = FStar_UInt8.uint_to_t (Prims.parse_int "3")
+let hs  = FStar_UInt8.uint_to_t (Prims.parse_int "4")
+let hsl = FStar_UInt8.uint_to_t (Prims.parse_int "5")
+let ks  = FStar_UInt8.uint_to_t (Prims.parse_int "6")
+let ngo = FStar_UInt8.uint_to_t (Prims.parse_int "7")
+let qic = FStar_UInt8.uint_to_t (Prims.parse_int "8")
+let rng = FStar_UInt8.uint_to_t (Prims.parse_int "9")
+let tck = FStar_UInt8.uint_to_t (Prims.parse_int "10")
+let tls = FStar_UInt8.uint_to_t (Prims.parse_int "11")
+let record = FStar_UInt8.uint_to_t (Prims.parse_int "12")
+
+let info = FStar_UInt8.uint_to_t (Prims.parse_int "1")
+let verbose = FStar_UInt8.uint_to_t (Prims.parse_int "2")
+
+let tags = [| "AEP"; "CDH"; "EPO"; "FFI"; "HS "; "HSL"; "KS "; "NGO"; "QIC"; "RNG"; "TCK"; "TLS"; "REC" |]
+
+let enabled : FStar_UInt8.t -> FStar_UInt8.t -> Prims.bool =
+  fun _ _ -> true
+
+let tracing : Prims.bool -> FStar_UInt8.t -> FStar_UInt8.t -> Prims.bool =
+  fun flag m l -> flag && enabled m l
+
+let print : FStar_UInt8.t -> Prims.string -> Prims.unit =
+  fun m s -> print_string (tags.(Z.to_int (FStar_UInt8.v m)) ^ "| " ^ s ^ "\n")
+
+let dump : FStar_UInt8.t -> FStar_UInt8.t -> Prims.string -> FStar_Bytes.bytes -> Prims.unit =
+  fun m _ label b ->
+    print_string (tags.(Z.to_int (FStar_UInt8.v m)) ^ "| " ^ label ^ ": " ^ FStar_Bytes.hex_of_bytes b ^ "\n")
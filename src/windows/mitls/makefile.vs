@@ -21,6 +21,12 @@ SOURCES = \
   HandshakeMessages.c \
   Hashing.c \
   kremlinit.c \
+  locks.c \
+  session_cache.c \
+  key_pool.c \
+  trace.c \
+  stats.c \
+  metrics.c \
   LowParse.c \
   Mem.c \
   mitlsffi.c \